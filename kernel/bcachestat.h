@@ -0,0 +1,18 @@
+/**
+* @file Buffer cache statistics.
+* Both the kernel and user programs (bcstat) use this header file.
+*/
+
+#ifndef BCACHESTAT_H
+#define BCACHESTAT_H
+
+struct bcachestat {
+  uint64 hits;       // bread() found the block cached
+  uint64 misses;     // bread() had to read the block from disk
+  uint64 evictions;  // recycled buffers that held another valid block
+  uint64 nbuf;       // buffers in the cache now
+  uint64 raissued;   // blocks read ahead
+  uint64 rahits;     // read-ahead blocks that bread() then asked for
+};
+
+#endif
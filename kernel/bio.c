@@ -1,10 +1,14 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Besides the NBUF static buffers, the cache grows by whole pages
+// of buffers while free memory lasts, and kalloc() takes idle pages
+// back through bshrink() when it runs out.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -12,6 +16,9 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * Code that only looks at a block may use bread_shared and
+//     brelse_shared instead; any number of such readers can
+//     hold the buffer at once, but none may change it.
 
 
 #include "types.h"
@@ -22,70 +29,327 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "hpm.h"
+#include "proc.h"
+#include "bcachestat.h"
+
+#define NBUCKET 61
+
+// Buffers are hashed by (dev, blockno) into buckets, so a lookup
+// only scans and locks one short chain. Each chain is sorted by
+// how recently its buffers were used: head.next is most recent,
+// head.prev is least.
+struct bucket {
+  struct spinlock lock;
+  struct buf head;
+};
+
+// A page from kalloc() holding extra buffers.
+#define BPERPAGE ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+struct bufpage {
+  struct bufpage *next;
+  struct buf buf[BPERPAGE];
+};
 
 struct {
+  // Serializes recycling, so that at most one CPU holds two
+  // bucket locks at once. Also protects free and pages.
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  struct buf free;          // new buffers that hold no block yet
+  struct bufpage *pages;    // oldest first
+  struct bcachestat stat;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // bget() sleeps here when every buffer is in use. It is a
+  // lock of its own because kalloc() may call bshrink() while
+  // holding a proc lock, so bcache.lock must not be held
+  // around sleep() or wakeup().
+  struct spinlock waitlock;
+  int nwait;                // processes sleeping for a buffer
+  uint nrelease;            // times a refcnt dropped to zero
 } bcache;
 
+static void bput(struct buf*);
+
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Link b in as the most recently used buffer of list head.
+static void
+push(struct buf *head, struct buf *b)
+{
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+static void
+unlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.waitlock, "bcache.wait");
+  bcache.free.prev = &bcache.free;
+  bcache.free.next = &bcache.free;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    push(&bcache.free, b);
+  }
+  bcache.stat.nbuf = NBUF;
+}
+
+// Add a page of buffers to the free list, if memory allows.
+static void
+bgrow(void)
+{
+  struct bufpage *pg, **pp;
+  int i;
+
+  if((pg = kalloc()) == 0)
+    return;
+  for(i = 0; i < BPERPAGE; i++){
+    initsleeplock(&pg->buf[i].lock, "buffer");
+    pg->buf[i].refcnt = 0;
+    pg->buf[i].valid = 0;
+  }
+
+  acquire(&bcache.lock);
+  for(i = 0; i < BPERPAGE; i++)
+    push(&bcache.free, &pg->buf[i]);
+  // Append, so that bshrink() frees the oldest pages first.
+  for(pp = &bcache.pages; *pp; pp = &(*pp)->next)
+    ;
+  pg->next = 0;
+  *pp = pg;
+  bcache.stat.nbuf += BPERPAGE;
+  release(&bcache.lock);
+}
+
+// Give up to n pages of idle buffers back to the page allocator.
+// Returns the number of pages freed. Called by kalloc() when it
+// runs out of memory.
+int
+bshrink(int n)
+{
+  struct bufpage **pp, *pg;
+  struct bucket *bk;
+  int i, freed = 0;
+
+  acquire(&bcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+
+  for(pp = &bcache.pages; (pg = *pp) != 0 && freed < n; ){
+    for(i = 0; i < BPERPAGE && pg->buf[i].refcnt == 0; i++)
+      ;
+    if(i < BPERPAGE){
+      pp = &pg->next;
+      continue;
+    }
+    // Every buffer is idle, hence clean: drop them.
+    for(i = 0; i < BPERPAGE; i++)
+      unlink(&pg->buf[i]);
+    *pp = pg->next;
+    bcache.stat.nbuf -= BPERPAGE;
+    kfree(pg);
+    freed++;
+  }
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    release(&bk->lock);
+  release(&bcache.lock);
+  return freed;
+}
+
+// Find b in bk. Caller holds bk->lock.
+static struct buf*
+lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
+}
+
+// Least recently used unused buffer of bk, or 0.
+// Caller holds bk->lock.
+static struct buf*
+victim(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev){
+    if(b->refcnt == 0)
+      return b;
+  }
+  return 0;
+}
+
+// Find a buffer to hold a new block of bucket bk: a free one,
+// else the least recently used unused one of bk, else one stolen
+// from another bucket. Returns 0 if every buffer is in use.
+// Caller holds bcache.lock and bk->lock.
+static struct buf*
+recycle(struct bucket *bk)
+{
+  struct bucket *other;
+  struct buf *b;
+  int i;
+
+  if(bcache.free.next != &bcache.free){
+    b = bcache.free.next;
+    unlink(b);
+    push(&bk->head, b);
+    return b;
+  }
+
+  if((b = victim(bk)) != 0)
+    return b;
+
+  for(i = 1; i < NBUCKET && b == 0; i++){
+    other = &bcache.bucket[(bk - bcache.bucket + i) % NBUCKET];
+    acquire(&other->lock);
+    if((b = victim(other)) != 0)
+      unlink(b);
+    release(&other->lock);
+  }
+  if(b)
+    push(&bk->head, b);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
+// In either case, return a referenced buffer; a new one is
+// returned locked, a cached one unlocked.
+// For read-ahead (ra), return 0 instead if the block is already
+// cached or bref() would have to wait, so that the caller never
+// blocks while holding buffers it has not submitted yet.
 static struct buf*
-bget(uint dev, uint blockno)
+bref(uint dev, uint blockno, int ra, int *locked)
 {
+  struct bucket *bk = hash(dev, blockno);
   struct buf *b;
+  uint gen;
 
-  acquire(&bcache.lock);
+  for(;;){
+    acquire(&bk->lock);
+
+    // Is the block already cached?
+    if((b = lookup(bk, dev, blockno)) != 0)
+      goto hit;
+    release(&bk->lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+    // Not cached. Grow rather than evict while memory is plentiful.
+    if(bcache.free.next == &bcache.free && kfreepages() > BCACHEMINFREE)
+      bgrow();
+
+    // Take the recycling lock and look again, since another
+    // CPU may have brought the block in meanwhile.
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    if((b = lookup(bk, dev, blockno)) != 0){
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      goto hit;
     }
-  }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+    gen = __atomic_load_n(&bcache.nrelease, __ATOMIC_SEQ_CST);
+    if((b = recycle(bk)) != 0){
+      if(b->valid)
+        __sync_fetch_and_add(&bcache.stat.evictions, 1);
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
+      b->ra = 0;
       b->refcnt = 1;
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
+      *locked = 1;
       return b;
     }
+    release(&bk->lock);
+    release(&bcache.lock);
+    if(ra)
+      return 0;
+
+    // Every buffer is in use. Wait for a brelse() and retry.
+    acquire(&bcache.waitlock);
+    bcache.nwait++;
+    __sync_synchronize();
+    while(__atomic_load_n(&bcache.nrelease, __ATOMIC_SEQ_CST) == gen)
+      sleep(&bcache.nwait, &bcache.waitlock);
+    bcache.nwait--;
+    release(&bcache.waitlock);
+  }
+
+hit:
+  if(ra){
+    release(&bk->lock);
+    return 0;
+  }
+  b->refcnt++;
+  release(&bk->lock);
+  *locked = 0;
+  return b;
+}
+
+// Return a locked buffer for the block.
+static struct buf*
+bget(uint dev, uint blockno, int ra)
+{
+  struct buf *b;
+  int locked;
+
+  if((b = bref(dev, blockno, ra, &locked)) != 0 && !locked)
+    acquiresleep(&b->lock);
+  return b;
+}
+
+// Count a hit on b, which is valid.
+static void
+bhit(struct buf *b)
+{
+  __sync_fetch_and_add(&bcache.stat.hits, 1);
+  // Shared holders may race here; only one counts the hit.
+  if(b->ra && __sync_bool_compare_and_swap(&b->ra, 1, 0))
+    __sync_fetch_and_add(&bcache.stat.rahits, 1);
+}
+
+// Read b in if it is not valid. b must be locked exclusively.
+static void
+bfill(struct buf *b)
+{
+  if(!b->valid) {
+    __sync_fetch_and_add(&bcache.stat.misses, 1);
+    iorw(b, 0);
+    b->valid = 1;
+  } else {
+    bhit(b);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,21 +358,125 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+  b = bget(dev, blockno, 0);
+  bfill(b);
+  return b;
+}
+
+// Return a locked buf for the indicated block, filled with
+// zeros instead of read from disk: for a block whose old
+// contents do not matter, such as one just allocated.
+struct buf*
+bgetz(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  b->ra = 0;
+  return b;
+}
+
+// Return a buf with the contents of the indicated block,
+// locked in shared mode. The caller must not change it, and
+// must release it with brelse_shared().
+struct buf*
+bread_shared(uint dev, uint blockno)
+{
+  struct buf *b;
+  int locked;
+
+  b = bref(dev, blockno, 0, &locked);
+  for(;;){
+    if(locked){
+      // New, or found not valid: read it in exclusively.
+      bfill(b);
+      releasesleep(&b->lock);
+    }
+    acquiresleep_shared(&b->lock);
+    if(b->valid)
+      break;
+    // Another process found the buffer before its reader
+    // got to lock it. Read it in ourselves.
+    releasesleep_shared(&b->lock);
+    acquiresleep(&b->lock);
+    locked = 1;
   }
+  if(!locked)
+    bhit(b);
   return b;
 }
 
+// Start reading up to NREADAHEAD blocks that will probably be
+// read soon, without waiting for them. Blocks that are cached
+// already are skipped. bdone() releases each buffer when its
+// read completes; a bread() of it meanwhile waits for the lock.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[NREADAHEAD];
+  struct buf *b;
+  int i, m = 0;
+
+  for(i = 0; i < n && m < NREADAHEAD; i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    b->async = 1;
+    b->ra = 1;
+    bs[m++] = b;
+  }
+  if(m > 0){
+    __sync_fetch_and_add(&bcache.stat.raissued, m);
+    iosubmit(bs, m, 0);
+  }
+}
+
+// Called by ioq.c when the asynchronous read of b
+// has completed. Release b on behalf of breadahead().
+void
+bdone(struct buf *b)
+{
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iorw(b, 1);
+}
+
+// Write bs[0..n-1], all locked, with the writes in flight
+// at the same time. Returns when all of them are on disk.
+void
+bwritev(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+  }
+  iosubmit(bs, n, 1);
+  iowait(bs, n);
+}
+
+// A buffer's refcnt dropped to zero; wake a bget() waiting for one.
+static void
+released(void)
+{
+  __sync_fetch_and_add(&bcache.nrelease, 1);
+  if(__atomic_load_n(&bcache.nwait, __ATOMIC_SEQ_CST)){
+    acquire(&bcache.waitlock);
+    wakeup(&bcache.nwait);
+    release(&bcache.waitlock);
+  }
 }
 
 // Release a locked buffer.
@@ -120,34 +488,63 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
+// Release a buffer from bread_shared().
+void
+brelse_shared(struct buf *b)
+{
+  releasesleep_shared(&b->lock);
+  bput(b);
+}
+
+// Drop a reference to b, whose lock has been released.
+static void
+bput(struct buf *b)
+{
+  // b cannot change buckets while it is referenced.
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    unlink(b);
+    push(&bk->head, b);
+    release(&bk->lock);
+    released();
+    return;
+  }
+
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+  int idle;
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  idle = b->refcnt == 0;
+  release(&bk->lock);
+  if(idle)
+    released();
 }
 
+// Copy the cache statistics to user address addr.
+int
+bcachestat(uint64 addr)
+{
+  struct proc *p = myproc();
 
+  return copyout(p->pagetable, addr, (char *)&bcache.stat, sizeof(bcache.stat));
+}
@@ -1,10 +1,14 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // read that bdone() finishes, with no one waiting
+  int write;   // queued request is a write
+  struct buf *qnext; // ioq.c: pending list, or rest of a merged request
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
+  int ra;      // read ahead and not asked for yet?
   struct buf *prev; // LRU cache list
   struct buf *next;
   uchar data[BSIZE];
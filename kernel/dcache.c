@@ -0,0 +1,172 @@
+// Directory entry cache.
+//
+// dirlookup() remembers what it finds in a directory, and what
+// it does not find, keyed by (directory, name), so that looking
+// up a hot path does not read the directories on the way. A
+// negative entry (inum 0) records that the directory has no
+// entry of that name.
+//
+// Whoever changes a directory entry updates the cache while
+// holding the directory's lock: dirlink() and sys_unlink().
+// iput() drops the entries of a directory it frees, so that
+// they cannot outlive its inode number.
+//
+// Entries are recycled in clock order, with one lock over all.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "hpm.h"
+#include "proc.h"
+#include "dcachestat.h"
+
+#define NDHASH 61
+
+struct dentry {
+  uint dev;
+  uint dir;              // directory's inum; 0 if unused
+  char name[DIRSIZ];
+  uint inum;             // 0 if the directory has no such entry
+  uint off;              // of the dirent in the directory
+  int used;              // looked up since the clock hand passed
+  struct dentry *next;   // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  int hand;
+  struct dcachestat stat;
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+bucket(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// Find the entry for name in directory dir.
+// Caller holds dcache.lock.
+static struct dentry*
+find(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = *bucket(dev, dir, name); d; d = d->next){
+    if(d->dev == dev && d->dir == dir && strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Take d off its hash chain and mark it unused.
+// Caller holds dcache.lock.
+static void
+unhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = bucket(d->dev, d->dir, d->name); *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+  d->dir = 0;
+}
+
+// Look up name in directory dir. Returns 1 and sets *inum
+// (0 for a negative entry) and *off if the cache knows,
+// 0 if the directory has to be read.
+int
+dlookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = find(dev, dir, name)) == 0){
+    dcache.stat.misses++;
+    release(&dcache.lock);
+    return 0;
+  }
+  d->used = 1;
+  *inum = d->inum;
+  *off = d->off;
+  if(d->inum)
+    dcache.stat.hits++;
+  else
+    dcache.stat.neghits++;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dir is inode inum, at offset
+// off, or that there is no such name if inum is 0.
+// Caller holds the directory's lock.
+void
+denter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dentry *d, **b;
+
+  acquire(&dcache.lock);
+  if((d = find(dev, dir, name)) == 0){
+    // Recycle the first entry the clock hand finds unused.
+    for(;;){
+      d = &dcache.dentry[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDENTRY;
+      if(!d->used)
+        break;
+      d->used = 0;
+    }
+    if(d->dir)
+      unhash(d);
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    b = bucket(dev, dir, name);
+    d->next = *b;
+    *b = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = 1;
+  release(&dcache.lock);
+}
+
+// Forget all entries of directory dir, which is being freed.
+void
+dpurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++){
+    if(d->dir == dir && d->dev == dev)
+      unhash(d);
+  }
+  release(&dcache.lock);
+}
+
+// Copy the cache statistics to user address addr.
+int
+dcachestat(uint64 addr)
+{
+  struct proc *p = myproc();
+
+  return copyout(p->pagetable, addr, (char *)&dcache.stat, sizeof(dcache.stat));
+}
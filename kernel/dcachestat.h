@@ -0,0 +1,15 @@
+/**
+* @file Directory entry cache statistics.
+* Both the kernel and user programs (bcstat) use this header file.
+*/
+
+#ifndef DCACHESTAT_H
+#define DCACHESTAT_H
+
+struct dcachestat {
+  uint64 hits;      // lookups answered with an inode
+  uint64 neghits;   // lookups answered with "no such name"
+  uint64 misses;    // lookups that read the directory
+};
+
+#endif
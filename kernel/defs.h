@@ -8,14 +8,25 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tracerec;
+struct hpmstat;
+struct cpu;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_shared(uint, uint);
+struct buf*     bgetz(uint, uint);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
+void            bwritev(struct buf**, int);
 void            brelse(struct buf*);
+void            brelse_shared(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachestat(uint64);
+int             bshrink(int);
 
 // console.c
 void            consoleinit(void);
@@ -38,31 +49,66 @@ int             filewrite(struct file*, uint64, int n);
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilock_shared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlock_shared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             iflush(struct inode*);
+void            iflushall(void);
+int             ifallocate(struct inode*, uint);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
-void            itrunc(struct inode*);
-int             getcwd(char*, uint);
+int             itrunc(struct inode*);
+int             getcwd(void);
+
+// dcache.c
+void            dcacheinit(void);
+int             dlookup(uint, uint, char*, uint*, uint*);
+void            denter(uint, uint, char*, uint, uint);
+void            dpurge(uint, uint);
+int             dcachestat(uint64);
+
+// hpm.c
+void            hpminit(void);
+int             hpmevent(int, uint64);
+void            hpmsync(struct cpu*);
+void            hpmread(struct hpmstat*);
+void            hpmcharge(struct hpmstat*, struct hpmstat*);
+void            hpmadd(struct hpmstat*, struct hpmstat*);
+
+// prof.c
+void            proffree(struct proc*);
+int             profalloc(struct proc*, int);
+void            profsample(uint64);
+int             profcopyout(struct proc*, uint64, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// ioq.c
+void            ioqinit(void);
+void            iosubmit(struct buf**, int, int);
+void            iowait(struct buf**, int);
+void            iorw(struct buf*, int);
+void            iodone(struct buf*);
+int             iostat(uint64);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+int             kfreepages(void);
 void            kinit(void);
 
 // log.c
@@ -70,6 +116,10 @@ void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_force(void);
+void            log_data(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -87,10 +137,15 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+int             kthread(char*, void (*)(void));
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             settrace(int, uint64);
+int             profile(int, int);
+int             profwait(int, uint64, int);
+int             hpmstat(int, uint64);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -119,13 +174,20 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             getlockstat(uint64, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleep_shared(struct sleeplock*);
+void            releasesleep_shared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// strace.c
+void            traceinit(void);
+void            trace_put(struct tracerec*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -184,7 +246,7 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_start(struct buf *, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
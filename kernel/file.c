@@ -11,6 +11,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "stat.h"
+#include "hpm.h"
 #include "proc.h"
 
 struct devsw devsw[NDEV];
@@ -22,7 +23,11 @@ struct {
 void
 fileinit(void)
 {
+  struct file *f;
+
   initlock(&ftable.lock, "ftable");
+  for(f = ftable.file; f < ftable.file + NFILE; f++)
+    initsleeplock(&f->offlock, "file.off");
 }
 
 // Allocate a file structure.
@@ -91,9 +96,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilock_shared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlock_shared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -118,10 +123,14 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
+    // The inode lock is shared with other readers, so
+    // f->off needs a lock of its own.
+    acquiresleep(&f->offlock);
+    ilock_shared(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
-    iunlock(f->ip);
+    iunlock_shared(f->ip);
+    releasesleep(&f->offlock);
   } else {
     panic("fileread");
   }
@@ -146,14 +155,16 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    // write at most MAXOPDATA blocks of data at a time,
+    // counting one for a non-aligned start and NDELAY for
+    // delayed blocks that writei() may have to allocate and
+    // write first. the data is not logged, and the metadata
+    // (i-node, extent block, allocation blocks) fits well
+    // within MAXOPBLOCKS. this really belongs lower down,
+    // since writei() might be writing a device like the console.
+    int max = (MAXOPDATA-1-NDELAY) * BSIZE;
     int i = 0;
+    acquiresleep(&f->offlock);
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -172,6 +183,7 @@ filewrite(struct file *f, uint64 addr, int n)
       }
       i += r;
     }
+    releasesleep(&f->offlock);
     ret = (i == n ? n : -1);
   } else {
     panic("filewrite");
@@ -5,6 +5,7 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
+  struct sleeplock offlock; // FD_INODE: serializes use of off
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
 };
@@ -13,20 +14,40 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+#define NEXTCACHE 4  // extents cached per in-memory inode
+#define NDELAY   16  // file blocks written but not allocated yet, per inode
+#define NDPAGE   (NDELAY*BSIZE/4096)  // pages holding them
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  struct sleeplock lock; // protects everything below here
+  struct inode *prev; // LRU list of its itable bucket
+  struct inode *next;
+  struct sleeplock lock; // protects everything below here; shared by readers
+  struct spinlock cachelock; // ecache and read-ahead state, for shared holders
   int valid;          // inode has been read from disk?
+  uint ranext;        // block a sequential reader reads next
+  uint raend;         // first block not read ahead yet
+  uint rawin;         // blocks to keep read ahead; 0 if not sequential
+  struct extent ecache[NEXTCACHE]; // extents used last
+  int ecnext;         // ecache[] slot to replace next
+  uint rnext;         // blocks reserved for a sequential writer
+  uint rend;          // are rnext .. rend-1
+  uint dstart;        // file blocks dstart .. dstart+ndelay-1 have
+  int ndelay;         // no disk blocks yet; their data is in dpage[]
+  char *dpage[NDPAGE];
+  int dlisted;        // on the flush list? protected by delay.lock
+  struct inode *dnext; // flush list
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint extblk;
 };
 
 // map major device number to device functions.
@@ -38,3 +59,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define TRACE   2
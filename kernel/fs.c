@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -32,11 +33,23 @@ readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
 
-  bp = bread(dev, 1);
+  bp = bread_shared(dev, 1);
   memmove(sb, bp->data, sizeof(*sb));
-  brelse(bp);
+  brelse_shared(bp);
 }
 
+static void ballocinit(int);
+static void iallocinit(int);
+static void flushd(void);
+static void orphaninit(int);
+
+// Inodes with delayed blocks, for flushd().
+static struct {
+  struct spinlock lock;
+  struct inode *head;
+  int nblocks;              // delayed blocks of all inodes
+} delay;
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,47 +57,293 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  ballocinit(dev);
+  iallocinit(dev);
+  orphaninit(dev);
+  initlock(&delay.lock, "delay");
+  if(kthread("flushd", flushd) < 0)
+    panic("fsinit: flushd");
 }
 
-// Zero a block.
+// Zero a metadata block.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bgetz(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// Metadata blocks (directory and extent blocks) are zeroed
+// when allocated. File data blocks are not: writei() never
+// leaves a gap, so whatever a new block held stays past the
+// end of the file, where no one reads it, until it is written.
+//
+// The allocator keeps a count of the free blocks under each
+// bitmap block, so that it never reads a full one, and scans
+// the bitmap 64 bits at a time. Allocation starts at a goal
+// block, normally the one after the file's last block.
+//
+// A sequential writer gets a run of up to NPREALLOC free
+// blocks reserved ahead of it (ip->rnext .. ip->rend-1), so
+// that files written at the same time do not interleave.
+// Reservations live only in memory, in alloc.resv; other
+// allocations avoid reserved blocks unless nothing else is
+// free. They are hints: the bitmap on disk, changed only under
+// its buffer's lock, decides which blocks are in use.
+//
+// Each delayed block (see below) holds one free block in
+// alloc.ndresv from the write that makes it until it is
+// flushed or dropped, so that the data it holds always finds
+// room on disk; other allocations leave that many free.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
-static uint
-balloc(uint dev)
+#define NBMAP (FSSIZE/BPB + 1)
+
+static struct {
+  struct spinlock lock;
+  int nfree[NBMAP];              // free blocks per bitmap block
+  uint64 resv[NBMAP * BPB / 64]; // blocks reserved for a writer
+  int ndresv;                    // free blocks held for delayed blocks
+} alloc;
+
+// Count the free blocks under each bitmap block.
+static void
+ballocinit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int b, bi;
 
-  bp = 0;
+  initlock(&alloc.lock, "alloc");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        alloc.nfree[b/BPB]++;
+    }
+    brelse(bp);
+  }
+}
+
+static int
+reserved(uint b)
+{
+  return (alloc.resv[b/64] >> (b % 64)) & 1;
+}
+
+static void
+setresv(uint b, int on)
+{
+  if(on)
+    alloc.resv[b/64] |= 1ULL << (b % 64);
+  else
+    alloc.resv[b/64] &= ~(1ULL << (b % 64));
+}
+
+// Find a block that is free on disk and not freed by the
+// uncommitted transaction, searching from goal on and
+// wrapping around. Unless steal is set, skip reserved blocks.
+// Mark it in use, and reserve up to nresv free blocks that
+// follow it. Returns the block and sets *nrun to one more
+// than the number reserved, or returns 0 if none is free.
+static uint
+bfind(uint dev, uint goal, int nresv, int *nrun, int steal)
+{
+  struct buf *bp;
+  uint64 *w, free;
+  uint base, start, b, r;
+  int i, n, bi, wi;
+
+  n = (sb.size + BPB - 1) / BPB;
+  if(goal >= sb.size)
+    goal = 0;
+  // The goal's bitmap block is visited twice: from the goal on,
+  // then, after wrapping around, the bits before it.
+  for(i = 0; i <= n; i++){
+    bi = (goal / BPB + i) % n;
+    if(alloc.nfree[bi] == 0)
+      continue;
+    base = bi * BPB;
+    start = i == 0 ? goal % BPB : 0;
+    bp = bread(dev, sb.bmapstart + bi);
+    w = (uint64*)bp->data;
+    acquire(&alloc.lock);
+    for(wi = start / 64; wi < BPB / 64; wi++){
+      free = ~w[wi];
+      if(!steal)
+        free &= ~alloc.resv[base/64 + wi];
+      if(wi == start / 64)
+        free &= ~0ULL << (start % 64);
+      for(; free; free &= free - 1){
+        b = base + wi*64 + __builtin_ctzll(free);
+        if(b >= sb.size)
+          break;
+        if(!log_freed(b))
+          goto found;
       }
     }
+    release(&alloc.lock);
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
+
+found:
+  bp->data[(b - base)/8] |= 1 << (b % 8);  // Mark block in use.
+  alloc.nfree[bi]--;
+  setresv(b, 0);
+  *nrun = 1;
+  for(r = b + 1; r < base + BPB && r < sb.size && *nrun <= nresv; r++){
+    if((bp->data[(r - base)/8] & (1 << (r % 8))) || reserved(r) || log_freed(r))
+      break;
+    setresv(r, 1);
+    (*nrun)++;
+  }
+  release(&alloc.lock);
+  log_write(bp);
+  brelse(bp);
+  return b;
+}
+
+// Number of free blocks not held for delayed blocks.
+// Caller holds alloc.lock.
+static int
+bavail(void)
+{
+  int i, n;
+
+  n = -alloc.ndresv;
+  for(i = 0; i < NBMAP; i++)
+    n += alloc.nfree[i];
+  return n;
+}
+
+// Hold a free block for a new delayed block.
+// Returns 0 if there is none to hold.
+static int
+dreserve(void)
+{
+  int ok;
+
+  acquire(&alloc.lock);
+  ok = bavail() > 0;
+  if(ok)
+    alloc.ndresv++;
+  release(&alloc.lock);
+  return ok;
+}
+
+// Let go of n blocks held for delayed blocks.
+static void
+dunreserve(int n)
+{
+  acquire(&alloc.lock);
+  alloc.ndresv -= n;
+  release(&alloc.lock);
+}
+
+// Is any free block not held for delayed blocks?
+static int
+bhasfree(void)
+{
+  int ok;
+
+  acquire(&alloc.lock);
+  ok = bavail() > 0;
+  release(&alloc.lock);
+  if(!ok)
+    printf("balloc: out of blocks\n");
+  return ok;
+}
+
+// Allocate a zeroed disk block as near after goal as possible.
+// Blocks freed by the uncommitted transaction are skipped.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+  int n;
+
+  if(!bhasfree())
+    return 0;
+  if((b = bfind(dev, goal, 0, &n, 0)) == 0 &&
+     (b = bfind(dev, goal, 0, &n, 1)) == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bzero(dev, b);
+  return b;
+}
+
+// Drop what is left of ip's reservation.
+static void
+bunreserve(struct inode *ip)
+{
+  uint b;
+
+  acquire(&alloc.lock);
+  for(b = ip->rnext; b < ip->rend; b++)
+    setresv(b, 0);
+  release(&alloc.lock);
+  ip->rnext = ip->rend = 0;
+}
+
+// Mark block b, reserved for a writer, in use.
+// Returns 0 if it has been allocated to someone else.
+static int
+btake(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, m, ok;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  acquire(&alloc.lock);
+  setresv(b, 0);
+  ok = (bp->data[bi/8] & m) == 0 && !log_freed(b);
+  if(ok){
+    bp->data[bi/8] |= m;
+    alloc.nfree[b/BPB]--;
+  }
+  release(&alloc.lock);
+  if(ok)
+    log_write(bp);
+  brelse(bp);
+  return ok;
+}
+
+// Allocate a data block, not zeroed, for file ip at goal, from the
+// blocks reserved for it if it is writing sequentially; if
+// not, search near goal and reserve the blocks after it.
+// Caller must hold ip->lock.
+// returns 0 if out of disk space.
+static uint
+bprealloc(struct inode *ip, uint goal)
+{
+  uint b;
+  int n;
+
+  if(!bhasfree())
+    return 0;
+  if(ip->rnext == goal && ip->rnext < ip->rend){
+    b = ip->rnext++;
+    if(btake(ip->dev, b))
+      return b;
+  }
+  bunreserve(ip);
+
+  if((b = bfind(ip->dev, goal, NPREALLOC - 1, &n, 0)) == 0 &&
+     (b = bfind(ip->dev, goal, 0, &n, 1)) == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  ip->rnext = b + 1;
+  ip->rend = b + n;
+  return b;
 }
 
 // Free a disk block.
@@ -100,8 +359,82 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  acquire(&alloc.lock);
+  alloc.nfree[b/BPB]++;
+  release(&alloc.lock);
   log_write(bp);
   brelse(bp);
+  log_free(b);
+}
+
+// A batch of runs of blocks to free at once, touching at
+// most NFREEBMAP bitmap blocks, so that it fits in one
+// transaction with the extent, inode and super blocks.
+#define NFREERUN 64
+#define NFREEBMAP (MAXOPBLOCKS - 4)
+
+struct fbatch {
+  int n;
+  struct extent run[NFREERUN];  // off unused
+  int nbmap;
+  uint bmap[NFREEBMAP];         // bitmap blocks of run[]
+};
+
+// Add blocks addr .. addr+len-1, all under one bitmap block,
+// to fb. Returns 0 if fb is full.
+static int
+fbadd(struct fbatch *fb, uint addr, uint len)
+{
+  int i;
+
+  if(fb->n == NFREERUN)
+    return 0;
+  for(i = 0; i < fb->nbmap && fb->bmap[i] != addr/BPB; i++)
+    ;
+  if(i == fb->nbmap){
+    if(fb->nbmap == NFREEBMAP)
+      return 0;
+    fb->bmap[fb->nbmap++] = addr/BPB;
+  }
+  fb->run[fb->n].addr = addr;
+  fb->run[fb->n].len = len;
+  fb->n++;
+  return 1;
+}
+
+// Free the blocks of fb, reading and logging each of its
+// bitmap blocks once.
+static void
+bfreev(int dev, struct fbatch *fb)
+{
+  struct buf *bp;
+  struct extent *r;
+  uint b;
+  int i, bi, m, nfreed;
+
+  for(i = 0; i < fb->nbmap; i++){
+    bp = bread(dev, sb.bmapstart + fb->bmap[i]);
+    nfreed = 0;
+    for(r = fb->run; r < &fb->run[fb->n]; r++){
+      if(r->addr/BPB != fb->bmap[i])
+        continue;
+      for(b = r->addr; b < r->addr + r->len; b++){
+        bi = b % BPB;
+        m = 1 << (bi % 8);
+        if((bp->data[bi/8] & m) == 0)
+          panic("freeing free block");
+        bp->data[bi/8] &= ~m;
+        log_free(b);
+      }
+      nfreed += r->len;
+    }
+    acquire(&alloc.lock);
+    alloc.nfree[fb->bmap[i]] += nfreed;
+    release(&alloc.lock);
+    log_write(bp);
+    brelse(bp);
+  }
+  fb->n = fb->nbmap = 0;
 }
 
 // Inodes.
@@ -130,17 +463,18 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
+//   can be recycled if ip->ref is zero. Otherwise ip->ref
+//   tracks the number of in-memory pointers to the entry
+//   (open files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
 //   decrements ref.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid if it frees
+//   the inode. An unreferenced entry stays valid, so that
+//   the next iget() of it need not read the disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,45 +498,242 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// Table entries are hashed by (dev, inum) into buckets, each
+// with its own lock and a list of its entries, most recently
+// used first. A bucket's lock protects the ref, dev, inum, prev
+// and next fields of its entries; one must hold it while using
+// any of those fields. Moving an entry to another bucket also
+// takes itable.lock, so that at most one CPU holds two bucket
+// locks at once. Besides the NINODE static entries, the table
+// grows by whole pages of entries while free memory lasts.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, prev and next.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 31
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode head;
+};
+
+// A page from kalloc() holding extra table entries.
+#define IPERPAGE ((PGSIZE - sizeof(void*)) / sizeof(struct inode))
+struct inodepage {
+  struct inodepage *next;
+  struct inode inode[IPERPAGE];
+};
+
 struct {
+  // Serializes recycling. Also protects free and pages.
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct ibucket bucket[NIBUCKET];
+  struct inode free;          // entries that hold no inode yet
+  struct inodepage *pages;
 } itable;
 
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 31 + inum) % NIBUCKET];
+}
+
+// Link ip in as the most recently used entry of list head.
+static void
+ipush(struct inode *head, struct inode *ip)
+{
+  ip->next = head->next;
+  ip->prev = head;
+  head->next->prev = ip;
+  head->next = ip;
+}
+
+static void
+iunlink(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
 void
 iinit()
 {
+  struct ibucket *bk;
   int i = 0;
   
   initlock(&itable.lock, "itable");
+  itable.free.prev = &itable.free;
+  itable.free.next = &itable.free;
+  for(bk = itable.bucket; bk < itable.bucket+NIBUCKET; bk++){
+    initlock(&bk->lock, "itable.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    initlock(&itable.inode[i].cachelock, "inode.cache");
+    ipush(&itable.free, &itable.inode[i]);
+  }
+}
+
+// Add a page of entries to the free list, if memory allows.
+static void
+igrow(void)
+{
+  struct inodepage *pg;
+  int i;
+
+  if((pg = kalloc()) == 0)
+    return;
+  memset(pg, 0, sizeof(*pg));
+  for(i = 0; i < IPERPAGE; i++){
+    initsleeplock(&pg->inode[i].lock, "inode");
+    initlock(&pg->inode[i].cachelock, "inode.cache");
+  }
+
+  acquire(&itable.lock);
+  for(i = 0; i < IPERPAGE; i++)
+    ipush(&itable.free, &pg->inode[i]);
+  pg->next = itable.pages;
+  itable.pages = pg;
+  release(&itable.lock);
+}
+
+// Find inode inum of dev in bk. Caller holds bk->lock.
+static struct inode*
+ilookup(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  }
+  return 0;
+}
+
+// Least recently used unreferenced entry of bk, or 0.
+// Caller holds bk->lock.
+static struct inode*
+ivictim(struct ibucket *bk)
+{
+  struct inode *ip;
+
+  for(ip = bk->head.prev; ip != &bk->head; ip = ip->prev){
+    if(ip->ref == 0)
+      return ip;
   }
+  return 0;
+}
+
+// Find an entry to hold a new inode of bucket bk: a free one,
+// else the least recently used unreferenced one of bk, else
+// one taken from another bucket. Returns 0 if all are in use.
+// Caller holds itable.lock and bk->lock.
+static struct inode*
+irecycle(struct ibucket *bk)
+{
+  struct ibucket *other;
+  struct inode *ip;
+  int i;
+
+  if(itable.free.next != &itable.free){
+    ip = itable.free.next;
+    iunlink(ip);
+    ipush(&bk->head, ip);
+    return ip;
+  }
+
+  if((ip = ivictim(bk)) != 0)
+    return ip;
+
+  for(i = 1; i < NIBUCKET && ip == 0; i++){
+    other = &itable.bucket[(bk - itable.bucket + i) % NIBUCKET];
+    acquire(&other->lock);
+    if((ip = ivictim(other)) != 0)
+      iunlink(ip);
+    release(&other->lock);
+  }
+  if(ip)
+    ipush(&bk->head, ip);
+  return ip;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void ddiscard(struct inode*);
+static int ihasblocks(struct inode*);
+static int ifreestep(struct inode*);
+static void orphanadd(struct inode*);
+
+// Free inodes, read from the inode blocks at mount so that
+// ialloc() need not search them. A set bit is a free inode.
+static struct {
+  struct spinlock lock;
+  uint64 free[NINODES/64 + 1];
+} imap;
 
-// Allocate an inode on device dev.
-// Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode,
-// or NULL if there is no free inode.
-struct inode*
-ialloc(uint dev, short type)
+static void
+iallocinit(int dev)
 {
-  int inum;
   struct buf *bp;
   struct dinode *dip;
+  int inum;
 
+  if(sb.ninodes > NINODES)
+    panic("iallocinit: too many inodes");
+  initlock(&imap.lock, "imap");
   for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread_shared(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0)
+      imap.free[inum/64] |= 1ULL << (inum % 64);
+    brelse_shared(bp);
+  }
+}
+
+// Take a free inode from the map, the first one at or after
+// the start of near's inode block, wrapping around.
+// Returns 0 if there is none.
+static uint
+imap_take(uint near)
+{
+  uint64 free;
+  uint inum, start;
+  int i, n, wi;
+
+  start = near - near % IPB;
+  if(start >= sb.ninodes)
+    start = 0;
+  n = (sb.ninodes + 63) / 64;
+  acquire(&imap.lock);
+  for(i = 0; i <= n; i++){
+    wi = (start / 64 + i) % n;
+    free = imap.free[wi];
+    if(i == 0)
+      free &= ~0ULL << (start % 64);
+    if(free){
+      inum = wi * 64 + __builtin_ctzll(free);
+      imap.free[wi] &= ~(1ULL << (inum % 64));
+      release(&imap.lock);
+      return inum;
+    }
+  }
+  release(&imap.lock);
+  return 0;
+}
+
+// Like ialloc(), but without complaining if there is no
+// free inode.
+static struct inode*
+itryalloc(uint dev, short type, uint near)
+{
+  uint inum;
+  struct buf *bp;
+  struct dinode *dip;
+
+  while((inum = imap_take(near)) != 0){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
@@ -212,12 +743,35 @@ ialloc(uint dev, short type)
       brelse(bp);
       return iget(dev, inum);
     }
-    brelse(bp);
+    brelse(bp);  // the map was wrong; leave it marked in use
   }
-  printf("ialloc: no inodes\n");
   return 0;
 }
 
+// Allocate an inode on device dev, near inode near
+// (the directory it will be linked into).
+// Mark it as allocated by  giving it type type.
+// Returns an unlocked but allocated and referenced inode,
+// or NULL if there is no free inode.
+struct inode*
+ialloc(uint dev, short type, uint near)
+{
+  struct inode *ip;
+
+  if((ip = itryalloc(dev, type, near)) == 0)
+    printf("ialloc: no inodes\n");
+  return ip;
+}
+
+// Return inode inum, freed on disk, to the map.
+static void
+ifree(uint inum)
+{
+  acquire(&imap.lock);
+  imap.free[inum/64] |= 1ULL << (inum % 64);
+  release(&imap.lock);
+}
+
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk.
@@ -234,8 +788,10 @@ iupdate(struct inode *ip)
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  // Delayed blocks are not on disk.
+  dip->size = ip->ndelay ? min(ip->size, ip->dstart*BSIZE) : ip->size;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->extblk = ip->extblk;
   log_write(bp);
   brelse(bp);
 }
@@ -246,33 +802,48 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(dev, inum);
+  struct inode *ip;
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&bk->lock);
+  if((ip = ilookup(bk, dev, inum)) != 0)
+    goto hit;
+  release(&bk->lock);
+
+  // Grow rather than recycle while memory is plentiful.
+  if(itable.free.next == &itable.free && kfreepages() > BCACHEMINFREE)
+    igrow();
+
+  // Take the recycling lock and look again, since another
+  // CPU may have brought the inode in meanwhile.
+  acquire(&itable.lock);
+  acquire(&bk->lock);
+  if((ip = ilookup(bk, dev, inum)) != 0){
+    release(&itable.lock);
+    goto hit;
   }
 
   // Recycle an inode entry.
-  if(empty == 0)
+  if((ip = irecycle(bk)) == 0)
     panic("iget: no inodes");
+  release(&itable.lock);
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->rawin = 0;
+  ip->rnext = 0;
+  ip->rend = 0;
+  release(&bk->lock);
+  return ip;
 
+hit:
+  ip->ref++;
+  release(&bk->lock);
   return ip;
 }
 
@@ -281,9 +852,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -292,164 +865,934 @@ idup(struct inode *ip)
 void
 ilock(struct inode *ip)
 {
-  struct buf *bp;
-  struct dinode *dip;
+  struct buf *bp;
+  struct dinode *dip;
+
+  if(ip == 0 || ip->ref < 1)
+    panic("ilock");
+
+  acquiresleep(&ip->lock);
+
+  if(ip->valid == 0){
+    bp = bread_shared(ip->dev, IBLOCK(ip->inum, sb));
+    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    ip->type = dip->type;
+    ip->major = dip->major;
+    ip->minor = dip->minor;
+    ip->nlink = dip->nlink;
+    ip->size = dip->size;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->extblk = dip->extblk;
+    brelse_shared(bp);
+    memset(ip->ecache, 0, sizeof(ip->ecache));
+    ip->valid = 1;
+    if(ip->type == 0)
+      panic("ilock: no type");
+  }
+}
+
+// Lock the given inode in shared mode, for reading only:
+// readi(), stati() and dirlookup(). Other readers may hold
+// it at the same time.
+void
+ilock_shared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilock_shared");
+
+  for(;;){
+    acquiresleep_shared(&ip->lock);
+    if(ip->valid)
+      return;
+    // Read it in with the lock held exclusively.
+    releasesleep_shared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+// Unlock the given inode.
+void
+iunlock(struct inode *ip)
+{
+  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+    panic("iunlock");
+
+  releasesleep(&ip->lock);
+}
+
+void
+iunlock_shared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlock_shared");
+
+  releasesleep_shared(&ip->lock);
+}
+
+// Drop a reference to an in-memory inode.
+// If that was the last reference, the inode table entry can
+// be recycled.
+// If that was the last reference and the inode has no links
+// to it, free the inode (and its content) on disk.
+// All calls to iput() must be inside a transaction in
+// case it has to free the inode.
+void
+iput(struct inode *ip)
+{
+  // ip cannot change buckets while it is referenced.
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
+
+  if(ip->ref == 1 && ip->valid && ip->nlink == 0){
+    // inode has no links and no other references: truncate and free.
+
+    // ip->ref == 1 means no other process can have ip locked,
+    // so this acquiresleep() won't block (or deadlock).
+    acquiresleep(&ip->lock);
+
+    release(&bk->lock);
+
+    if(ip->type == T_DIR)
+      dpurge(ip->dev, ip->inum);
+    ddiscard(ip);
+    if(ihasblocks(ip)){
+      // orphand frees the blocks, and then the inode.
+      orphanadd(ip);
+    } else {
+      ip->size = 0;
+      ip->type = 0;
+      iupdate(ip);
+      ifree(ip->inum);
+    }
+    ip->valid = 0;
+
+    releasesleep(&ip->lock);
+
+    acquire(&bk->lock);
+  }
+
+  // Nothing writes to an unreferenced inode.
+  if(ip->ref == 1)
+    bunreserve(ip);
+  ip->ref--;
+  if(ip->ref == 0){
+    iunlink(ip);
+    ipush(&bk->head, ip);
+  }
+  release(&bk->lock);
+}
+
+// Common idiom: unlock, then put.
+void
+iunlockput(struct inode *ip)
+{
+  iunlock(ip);
+  iput(ip);
+}
+
+// Inode content
+//
+// The content (data) associated with each inode is stored
+// in extents: runs of consecutive blocks on the disk. The
+// first NEXTENT extents are listed in ip->ext[], the rest
+// in a tree rooted at block ip->extblk: a single leaf of
+// extents, or an index of leaves once one leaf is full.
+// Files have no holes, so the extents cover file blocks
+// 0 .. n-1 in order, and blocks are only added at n.
+//
+// Each in-memory inode caches the extents it used last
+// in ip->ecache[], so that sequential access to a large
+// file does not read the tree for every block. Readers
+// holding ip->lock shared fill it in together, so it has
+// a spinlock of its own, ip->cachelock.
+
+// Remember extent e in ip's extent cache.
+static void
+ecache_put(struct inode *ip, struct extent *e)
+{
+  struct extent *c;
+
+  acquire(&ip->cachelock);
+  for(c = ip->ecache; c < &ip->ecache[NEXTCACHE]; c++){
+    if(c->len && c->off == e->off){
+      *c = *e;
+      release(&ip->cachelock);
+      return;
+    }
+  }
+  ip->ecache[ip->ecnext] = *e;
+  ip->ecnext = (ip->ecnext + 1) % NEXTCACHE;
+  release(&ip->cachelock);
+}
+
+// Index of the last of the n > 0 sorted entries in e[]
+// that starts at or before file block bn.
+static int
+esearch(struct extent *e, int n, uint bn)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(e[mid].off <= bn)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Return the locked leaf of ip's extent tree that holds
+// (or would hold) the extent for file block bn.
+// If shared, it is locked for reading only.
+static struct buf*
+eleaf(struct inode *ip, uint bn, int shared)
+{
+  struct buf *bp;
+  struct extblock *eb;
+  uint addr;
+
+  if(shared){
+    bp = bread_shared(ip->dev, ip->extblk);
+    eb = (struct extblock*)bp->data;
+    if(eb->depth == 0)
+      return bp;
+    addr = eb->e[esearch(eb->e, eb->n, bn)].addr;
+    brelse_shared(bp);
+    return bread_shared(ip->dev, addr);
+  }
+
+  bp = bread(ip->dev, ip->extblk);
+  eb = (struct extblock*)bp->data;
+  if(eb->depth == 0)
+    return bp;
+  addr = eb->e[esearch(eb->e, eb->n, bn)].addr;
+  brelse(bp);
+  // Only the leaf changes; the index block was only looked at.
+  return bread(ip->dev, addr);
+}
+
+// Copy the extent of ip holding file block bn to *e.
+// Returns 0 if bn is past the last extent.
+static int
+elookup(struct inode *ip, uint bn, struct extent *e)
+{
+  struct extent *c;
+  struct buf *bp;
+  struct extblock *eb;
+  int i, found;
+
+  acquire(&ip->cachelock);
+  for(c = ip->ecache; c < &ip->ecache[NEXTCACHE]; c++){
+    if(c->len && bn >= c->off && bn < c->off + c->len){
+      *e = *c;
+      release(&ip->cachelock);
+      return 1;
+    }
+  }
+  release(&ip->cachelock);
+
+  for(i = 0; i < NEXTENT && ip->ext[i].len; i++){
+    c = &ip->ext[i];
+    if(bn >= c->off && bn < c->off + c->len){
+      *e = *c;
+      ecache_put(ip, e);
+      return 1;
+    }
+  }
+  if(ip->extblk == 0)
+    return 0;
+
+  found = 0;
+  bp = eleaf(ip, bn, 1);
+  eb = (struct extblock*)bp->data;
+  if(eb->n > 0){
+    c = &eb->e[esearch(eb->e, eb->n, bn)];
+    if(bn >= c->off && bn < c->off + c->len){
+      *e = *c;
+      ecache_put(ip, e);
+      found = 1;
+    }
+  }
+  brelse_shared(bp);
+  return found;
+}
+
+// Write back extent e of ip, which has grown.
+// The caller's iupdate() writes extents kept in the inode.
+static void
+eupdate(struct inode *ip, struct extent *e)
+{
+  struct buf *bp;
+  struct extblock *eb;
+  int i;
+
+  ecache_put(ip, e);
+  for(i = 0; i < NEXTENT; i++){
+    if(ip->ext[i].len && ip->ext[i].off == e->off){
+      ip->ext[i] = *e;
+      return;
+    }
+  }
+  bp = eleaf(ip, e->off, 0);
+  eb = (struct extblock*)bp->data;
+  i = esearch(eb->e, eb->n, e->off);
+  if(eb->e[i].off != e->off)
+    panic("eupdate");
+  eb->e[i] = *e;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Add extent e after the last extent of ip, growing the
+// tree as needed. Returns -1 if out of disk space, or if
+// the file has as many extents as the tree can hold.
+static int
+einsert(struct inode *ip, struct extent *e)
+{
+  struct buf *bp;
+  struct extblock *eb;
+  struct extent idx;
+  uint leaf, root;
+  int i;
+
+  for(i = 0; i < NEXTENT; i++){
+    if(ip->ext[i].len == 0){
+      ip->ext[i] = *e;
+      return 0;
+    }
+  }
+
+  // A newly allocated block is zeroed: an empty leaf.
+  if(ip->extblk == 0 && (ip->extblk = balloc(ip->dev, e->addr)) == 0)
+    return -1;
+  bp = eleaf(ip, e->off, 0);
+  eb = (struct extblock*)bp->data;
+  if(eb->n < NEXTPB){
+    eb->e[eb->n++] = *e;
+    log_write(bp);
+    brelse(bp);
+    return 0;
+  }
+  brelse(bp);
+
+  // The last leaf is full; start another one under the index.
+  bp = bread(ip->dev, ip->extblk);
+  eb = (struct extblock*)bp->data;
+  if(eb->depth == 1 && eb->n == NEXTPB){
+    brelse(bp);
+    return -1;
+  }
+  if((leaf = balloc(ip->dev, e->addr)) == 0){
+    brelse(bp);
+    return -1;
+  }
+  if(eb->depth == 0){
+    // The root is that leaf: put an index above it.
+    if((root = balloc(ip->dev, e->addr)) == 0){
+      brelse(bp);
+      bfree(ip->dev, leaf);
+      return -1;
+    }
+    idx.off = eb->e[0].off;
+    idx.addr = ip->extblk;
+    idx.len = 0;
+    brelse(bp);
+    ip->extblk = root;
+    bp = bread(ip->dev, root);
+    eb = (struct extblock*)bp->data;
+    eb->depth = 1;
+    eb->e[eb->n++] = idx;
+  }
+  idx.off = e->off;
+  idx.addr = leaf;
+  idx.len = 0;
+  eb->e[eb->n++] = idx;
+  log_write(bp);
+  brelse(bp);
+
+  bp = bread(ip->dev, leaf);
+  eb = (struct extblock*)bp->data;
+  eb->e[eb->n++] = *e;
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Allocate file block bn of ip, the first block past its last
+// extent. Grows the last extent if the new block follows it.
+// A directory block is zeroed; a file block is not.
+// returns 0 if out of disk space.
+static uint
+eappend(struct inode *ip, uint bn)
+{
+  struct extent last, e;
+  uint addr, goal;
+
+  goal = 0;
+  if(bn > 0){
+    if(elookup(ip, bn - 1, &last) == 0)
+      panic("bmap: hole");
+    goal = last.addr + last.len;
+  }
+  if(ip->type == T_DIR)
+    addr = balloc(ip->dev, goal);
+  else
+    addr = bprealloc(ip, goal);
+  if(addr == 0)
+    return 0;
+
+  if(bn > 0 && last.addr + last.len == addr){
+    last.len++;
+    eupdate(ip, &last);
+    return addr;
+  }
+  e.off = bn;
+  e.addr = addr;
+  e.len = 1;
+  if(einsert(ip, &e) < 0){
+    bfree(ip->dev, addr);
+    return 0;
+  }
+  ecache_put(ip, &e);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one; for a file,
+// the caller must treat it as past the end of the file.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  struct extent e;
+
+  if(elookup(ip, bn, &e))
+    return e.addr + (bn - e.off);
+  return eappend(ip, bn);
+}
+
+// Move blocks of the last of the n extents in es[] to fb,
+// from the end back, as long as fb has room. Each step takes
+// the part of an extent under one bitmap block. Returns the
+// number of extents left.
+static int
+etake(struct fbatch *fb, struct extent *es, int n)
+{
+  struct extent *e;
+  uint start;
+
+  while(n > 0){
+    e = &es[n-1];
+    if(e->len == 0){
+      n--;
+      continue;
+    }
+    start = (e->addr + e->len - 1) / BPB * BPB;
+    if(start < e->addr)
+      start = e->addr;
+    if(!fbadd(fb, start, e->addr + e->len - start))
+      break;
+    e->len = start - e->addr;
+    if(e->len == 0){
+      memset(e, 0, sizeof(*e));
+      n--;
+    }
+  }
+  return n;
+}
+
+// Free a batch of ip's blocks, from the end of the file back,
+// and write back the extents that are left, in one transaction.
+// Returns 1 if ip has more blocks.
+// Caller must hold ip->lock and be in a transaction.
+static int
+ifreestep(struct inode *ip)
+{
+  struct fbatch fb;
+  struct buf *bp, *lp;
+  struct extblock *eb, *lb;
+  uint leaf;
+
+  fb.n = fb.nbmap = 0;
+  memset(ip->ecache, 0, sizeof(ip->ecache));
+
+  if(ip->extblk == 0){
+    etake(&fb, ip->ext, NEXTENT);
+  } else {
+    bp = bread(ip->dev, ip->extblk);
+    eb = (struct extblock*)bp->data;
+    if(eb->depth == 0){
+      eb->n = etake(&fb, eb->e, eb->n);
+    } else if(eb->n > 0){
+      leaf = eb->e[eb->n-1].addr;
+      lp = bread(ip->dev, leaf);
+      lb = (struct extblock*)lp->data;
+      lb->n = etake(&fb, lb->e, lb->n);
+      if(lb->n == 0 && fbadd(&fb, leaf, 1))
+        eb->n--;
+      else
+        log_write(lp);
+      brelse(lp);
+    }
+    if(eb->n == 0 && fbadd(&fb, ip->extblk, 1))
+      ip->extblk = 0;
+    else
+      log_write(bp);
+    brelse(bp);
+  }
+
+  bfreev(ip->dev, &fb);
+  iupdate(ip);
+  return ip->extblk != 0 || ip->ext[0].len != 0;
+}
+
+// Delayed allocation.
+//
+// A write past the last block of a regular file does not
+// allocate disk blocks: its data waits in memory, in up to
+// NDELAY delayed blocks per inode (ip->dstart onwards). They
+// get disk blocks, all at once and so mostly in one extent,
+// and go to disk with the next commit when iflush() runs:
+// when the inode has NDELAY of them, on fsync(), and from the
+// flushd thread, FLUSHTICKS after the first write or sooner
+// if memory runs short. The size on disk does not count them.
+//
+// The flush list holds a reference to each inode on it, so
+// that an inode with delayed blocks stays in memory.
+//
+// Each delayed block holds a free disk block (dreserve()), so
+// a write that finds none left fails at write() time instead.
+// Only a flush that also needs new extent blocks can still run
+// out of space; it loses the data that did not fit, and the
+// file is cut short.
+
+#define DBPP (PGSIZE / BSIZE)  // delayed blocks per page
+
+// Data of delayed block i (file block ip->dstart+i) of ip.
+static char*
+dpdata(struct inode *ip, int i)
+{
+  return ip->dpage[i / DBPP] + (i % DBPP) * BSIZE;
+}
+
+// Free the memory of ip's delayed blocks.
+static void
+dfree(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < ip->ndelay; i += DBPP)
+    kfree(ip->dpage[i / DBPP]);
+  acquire(&delay.lock);
+  delay.nblocks -= ip->ndelay;
+  release(&delay.lock);
+  ip->ndelay = 0;
+}
+
+// Drop ip's delayed blocks. Caller must hold ip->lock.
+static void
+ddiscard(struct inode *ip)
+{
+  if(ip->ndelay == 0)
+    return;
+  dunreserve(ip->ndelay);
+  dfree(ip);
+}
+
+// Allocate disk blocks for ip's delayed blocks and write
+// them with the current transaction. Returns -1 if the disk
+// is full, having cut the file short.
+// Caller must hold ip->lock and be in a transaction.
+int
+iflush(struct inode *ip)
+{
+  struct buf *bp;
+  uint addr;
+  int i, r = 0;
+
+  if(ip->ndelay == 0)
+    return 0;
+
+  // The blocks held for them are the ones to allocate now.
+  dunreserve(ip->ndelay);
+  for(i = 0; i < ip->ndelay; i++){
+    if((addr = bmap(ip, ip->dstart + i)) == 0){
+      printf("iflush: out of blocks; inode %d cut short\n", ip->inum);
+      if(ip->size > (ip->dstart + i) * BSIZE)
+        ip->size = (ip->dstart + i) * BSIZE;
+      r = -1;
+      break;
+    }
+    bp = bgetz(ip->dev, addr);
+    memmove(bp->data, dpdata(ip, i), BSIZE);
+    log_data(bp);
+    brelse(bp);
+  }
+  dfree(ip);
+  iupdate(ip);
+  return r;
+}
+
+// Flush every inode on the flush list.
+void
+iflushall(void)
+{
+  struct inode *ip;
+
+  for(;;){
+    acquire(&delay.lock);
+    if((ip = delay.head) != 0){
+      delay.head = ip->dnext;
+      ip->dlisted = 0;
+    }
+    release(&delay.lock);
+    if(ip == 0)
+      return;
+
+    // Drop the list's reference inside the transaction,
+    // since the inode may have been unlinked.
+    begin_op();
+    ilock(ip);
+    iflush(ip);
+    iunlock(ip);
+    iput(ip);
+    end_op();
+  }
+}
+
+// Are delayed blocks taking up memory that is needed?
+static int
+dpressure(void)
+{
+  return __atomic_load_n(&delay.nblocks, __ATOMIC_RELAXED) > NDELAYMAX ||
+         kfreepages() < BCACHEMINFREE;
+}
+
+// The flusher thread. It sleeps until there is something on
+// the flush list, lets more writes gather for FLUSHTICKS, and
+// then flushes everything.
+static void
+flushd(void)
+{
+  uint ticks0;
+
+  for(;;){
+    acquire(&delay.lock);
+    while(delay.head == 0)
+      sleep(&delay, &delay.lock);
+    release(&delay.lock);
+
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < FLUSHTICKS && !dpressure())
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    iflushall();
+  }
+}
+
+// Find the memory for file block bn of regular file ip, if
+// it is or can become a delayed block, and set *d to it.
+// Returns 1 if so, 0 if the block is on disk (or memory is
+// short, so it should be), -1 if flushing the delayed blocks
+// cut the file short, and -2 if the disk has no room for it.
+// Caller must hold ip->lock and be in a transaction.
+static int
+dblock(struct inode *ip, uint bn, char **d)
+{
+  struct extent e;
+  int i, listed;
 
-  if(ip == 0 || ip->ref < 1)
-    panic("ilock");
+  if(ip->ndelay == 0){
+    if(elookup(ip, bn, &e))
+      return 0;
+    ip->dstart = bn;
+  } else if(bn < ip->dstart){
+    return 0;
+  }
 
-  acquiresleep(&ip->lock);
+  i = bn - ip->dstart;
+  if(i < ip->ndelay){
+    *d = dpdata(ip, i);
+    return 1;
+  }
 
-  if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
-    ip->major = dip->major;
-    ip->minor = dip->minor;
-    ip->nlink = dip->nlink;
-    ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
-    brelse(bp);
-    ip->valid = 1;
-    if(ip->type == 0)
-      panic("ilock: no type");
+  // A new one, following the last.
+  if(i == NDELAY){
+    if(iflush(ip) < 0)
+      return -1;
+    return dblock(ip, bn, d);
   }
+  if(!dreserve())
+    return -2;
+  if(i % DBPP == 0 && (ip->dpage[i / DBPP] = kalloc()) == 0){
+    // Write directly from now on.
+    dunreserve(1);
+    return iflush(ip);
+  }
+  memset(dpdata(ip, i), 0, BSIZE);
+  ip->ndelay++;
+
+  acquire(&delay.lock);
+  delay.nblocks++;
+  listed = ip->dlisted;
+  if(!listed){
+    ip->dlisted = 1;
+    ip->dnext = delay.head;
+    delay.head = ip;
+    wakeup(&delay);
+  }
+  release(&delay.lock);
+  // flushd cannot drop this reference before we
+  // release ip->lock.
+  if(!listed)
+    idup(ip);
+
+  *d = dpdata(ip, i);
+  return 1;
 }
 
-// Unlock the given inode.
-void
-iunlock(struct inode *ip)
+// Allocate disk blocks for file blocks of ip up to nb-1, from
+// the first block it does not have (there are no holes), at
+// most NPREALLOC of them, flushing delayed blocks first.
+// The blocks are not zeroed and the size does not change, so
+// they stay past the end of the file until written.
+// Returns the number allocated, or -1 if the disk is full.
+// Caller must hold ip->lock and be in a transaction.
+int
+ifallocate(struct inode *ip, uint nb)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
-    panic("iunlock");
+  struct extent e;
+  uint bn;
+  int n;
 
-  releasesleep(&ip->lock);
+  if(iflush(ip) < 0)
+    return -1;
+
+  bn = 0;
+  while(bn < nb && elookup(ip, bn, &e))
+    bn = e.off + e.len;
+  for(n = 0; bn < nb && n < NPREALLOC; bn++, n++){
+    if(bmap(ip, bn) == 0){
+      n = -1;
+      break;
+    }
+  }
+  if(n != 0)
+    iupdate(ip);
+  return n;
 }
 
-// Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
-// If that was the last reference and the inode has no links
-// to it, free the inode (and its content) on disk.
-// All calls to iput() must be inside a transaction in
-// case it has to free the inode.
-void
-iput(struct inode *ip)
-{
-  acquire(&itable.lock);
+// Orphans.
+//
+// Freeing the blocks of a big file touches many bitmap and
+// extent blocks, more than one transaction can hold. So iput()
+// does not free the blocks of an unlinked inode itself: it puts
+// the inode on the orphan list in the same transaction that
+// drops the last link, and the orphand thread frees the blocks
+// a batch per transaction, from the end of the file back, and
+// then, in one more, the inode. itrunc() hands the blocks to a
+// new unlinked inode, so that it returns at once too.
+//
+// The list starts at sb.orphan on disk and goes on through the
+// major field of each orphan's dinode, which an unlinked file
+// has no other use for, so listing an inode cannot fail.
+// orphanadd() pushes at the head. The list only changes with
+// the buffer of block 1 locked; sb.orphan is not kept up to
+// date. Orphans have no valid in-memory copy, except the one
+// orphanstep() is working on, so the dinodes of the others can
+// be changed in their buffers.
+//
+// After a crash, fsinit() runs once recover_from_log() has
+// installed the last transaction, and orphand picks up the
+// orphans still listed where it left off.
 
-  if(ip->ref == 1 && ip->valid && ip->nlink == 0){
-    // inode has no links and no other references: truncate and free.
+static struct {
+  struct spinlock lock;
+  int n;          // orphans listed
+  uint dev;
+} orphans;
 
-    // ip->ref == 1 means no other process can have ip locked,
-    // so this acquiresleep() won't block (or deadlock).
-    acquiresleep(&ip->lock);
+static int
+ihasblocks(struct inode *ip)
+{
+  return ip->ext[0].len != 0 || ip->extblk != 0;
+}
 
-    release(&itable.lock);
+// Put ip, which has no links left, on the orphan list.
+// Caller must hold ip->lock and be in a transaction.
+static void
+orphanadd(struct inode *ip)
+{
+  struct buf *bp;
+  struct superblock *s;
 
-    itrunc(ip);
-    ip->type = 0;
-    iupdate(ip);
-    ip->valid = 0;
+  bp = bread(ip->dev, 1);
+  s = (struct superblock*)bp->data;
+  ip->major = s->orphan;
+  s->orphan = ip->inum;
+  iupdate(ip);
+  log_write(bp);
+  brelse(bp);
 
-    releasesleep(&ip->lock);
+  acquire(&orphans.lock);
+  orphans.n++;
+  wakeup(&orphans);
+  release(&orphans.lock);
+}
+
+// Take orphan ip off the list. Others may have been pushed
+// ahead of it since orphanstep() found it at the head.
+// Caller must hold ip->lock and be in a transaction.
+static void
+orphandel(struct inode *ip)
+{
+  struct buf *bp, *ibp;
+  struct superblock *s;
+  struct dinode *dip;
+  uint inum;
 
-    acquire(&itable.lock);
+  bp = bread(ip->dev, 1);
+  s = (struct superblock*)bp->data;
+  if(s->orphan == ip->inum){
+    s->orphan = (ushort)ip->major;
+    log_write(bp);
+  } else {
+    for(inum = s->orphan; ; inum = (ushort)dip->major){
+      if(inum == 0)
+        panic("orphandel");
+      ibp = bread(ip->dev, IBLOCK(inum, sb));
+      dip = (struct dinode*)ibp->data + inum%IPB;
+      if((ushort)dip->major == ip->inum){
+        dip->major = ip->major;
+        log_write(ibp);
+        brelse(ibp);
+        break;
+      }
+      brelse(ibp);
+    }
   }
+  brelse(bp);
+  ip->major = 0;
 
-  ip->ref--;
-  release(&itable.lock);
+  acquire(&orphans.lock);
+  orphans.n--;
+  release(&orphans.lock);
 }
 
-// Common idiom: unlock, then put.
-void
-iunlockput(struct inode *ip)
+// Free one batch of the blocks of the first orphan, in a
+// transaction of its own; once they are gone, free the inode.
+static void
+orphanstep(void)
 {
+  struct buf *bp;
+  struct inode *ip;
+  uint inum;
+
+  begin_op();
+  bp = bread_shared(orphans.dev, 1);
+  inum = ((struct superblock*)bp->data)->orphan;
+  brelse_shared(bp);
+  if(inum == 0){
+    end_op();
+    return;
+  }
+
+  ip = iget(orphans.dev, inum);
+  ilock(ip);
+  if(ihasblocks(ip)){
+    ifreestep(ip);
+  } else {
+    orphandel(ip);
+    ip->size = 0;
+    ip->type = 0;
+    iupdate(ip);
+    ifree(ip->inum);
+  }
+  // Keep iput() from listing it again.
+  ip->valid = 0;
   iunlock(ip);
   iput(ip);
+  end_op();
 }
 
-// Inode content
-//
-// The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
-
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
-static uint
-bmap(struct inode *ip, uint bn)
+// The orphan thread frees the blocks of orphans while
+// there are any.
+static void
+orphand(void)
 {
-  uint addr, *a;
-  struct buf *bp;
+  for(;;){
+    acquire(&orphans.lock);
+    while(orphans.n == 0)
+      sleep(&orphans, &orphans.lock);
+    release(&orphans.lock);
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+    orphanstep();
   }
-  bn -= NDIRECT;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
-    }
-    brelse(bp);
-    return addr;
+// Count the orphans a crash left, and start orphand.
+static void
+orphaninit(int dev)
+{
+  struct buf *bp;
+  uint inum;
+
+  initlock(&orphans.lock, "orphans");
+  orphans.dev = dev;
+  bp = bread_shared(dev, 1);
+  inum = ((struct superblock*)bp->data)->orphan;
+  brelse_shared(bp);
+  while(inum != 0){
+    orphans.n++;
+    bp = bread_shared(dev, IBLOCK(inum, sb));
+    inum = (ushort)((struct dinode*)bp->data + inum%IPB)->major;
+    brelse_shared(bp);
   }
-
-  panic("bmap: out of range");
+  if(orphans.n)
+    printf("fs: freeing %d orphan inodes\n", orphans.n);
+  if(kthread("orphand", orphand) < 0)
+    panic("orphaninit: orphand");
 }
 
 // Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
+// The blocks go to a new unlinked inode, which orphand frees.
+// Returns -1, leaving the file as it is, if no inode is free.
+// Caller must hold ip->lock and be in a transaction.
+int
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  struct inode *g = 0;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
+  if(ihasblocks(ip) && (g = itryalloc(ip->dev, ip->type, ip->inum)) == 0)
+    return -1;
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  memset(ip->ecache, 0, sizeof(ip->ecache));
+  bunreserve(ip);
+  ddiscard(ip);
+
+  if(g){
+    ilock(g);
+    memmove(g->ext, ip->ext, sizeof(ip->ext));
+    g->extblk = ip->extblk;
+    g->size = ip->size;
+    g->nlink = 0;
+    iupdate(g);
+    iunlock(g);
+    memset(ip->ext, 0, sizeof(ip->ext));
+    ip->extblk = 0;
+    iput(g);  // lists g as an orphan
   }
 
   ip->size = 0;
   iupdate(ip);
+  return 0;
 }
 
 // Copy stat information from inode.
@@ -464,6 +1807,54 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Read ahead for a reader of ip that is about to read block bn.
+// While reads stay sequential the window doubles, up to NREADAHEAD
+// blocks; any other access closes it.
+// Caller must hold ip->lock, shared or not.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint addr, start, end;
+  uint addrs[NREADAHEAD];
+  int n = 0;
+
+  acquire(&ip->cachelock);
+  if(bn + 1 == ip->ranext){
+    release(&ip->cachelock);
+    return;  // still in the same block
+  }
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->raend = 0;
+    ip->rawin = 0;
+    release(&ip->cachelock);
+    return;
+  }
+
+  ip->ranext = bn + 1;
+  ip->rawin = ip->rawin ? ip->rawin * 2 : 4;
+  if(ip->rawin > NREADAHEAD)
+    ip->rawin = NREADAHEAD;
+
+  end = bn + 1 + ip->rawin;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  if(ip->ndelay && end > ip->dstart)
+    end = ip->dstart;  // those are in memory, with no disk blocks
+  start = ip->raend < bn + 1 ? bn + 1 : ip->raend;
+  if(ip->raend < end)
+    ip->raend = end;
+  release(&ip->cachelock);
+
+  for(; start < end && n < NREADAHEAD; start++){
+    if((addr = bmap(ip, start)) == 0)
+      break;
+    addrs[n++] = addr;
+  }
+  if(n > 0)
+    breadahead(ip->dev, addrs, n);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -480,17 +1871,26 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(ip->ndelay && off/BSIZE >= ip->dstart){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyout(user_dst, dst, dpdata(ip, off/BSIZE - ip->dstart) + off%BSIZE, m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
+    bp = bread_shared(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
+      brelse_shared(bp);
       tot = -1;
       break;
     }
-    brelse(bp);
+    brelse_shared(bp);
+    readahead(ip, off/BSIZE);
   }
   return tot;
 }
@@ -507,6 +1907,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *d;
+  int r, mapped = 0;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -514,16 +1916,36 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    if(ip->type == T_FILE && (r = dblock(ip, off/BSIZE, &d)) != 0){
+      if(r == -1)
+        return -1;  // the file has been cut short
+      if(r < 0)
+        break;      // the disk is full
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyin(d + (off % BSIZE), user_src, src, m) == -1)
+        break;
+      continue;
+    }
+    mapped = 1;
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
+    // A block with nothing before the end of the file need
+    // not be read: it is new, or was allocated by fallocate().
+    if(ip->type == T_FILE && (off/BSIZE)*BSIZE >= ip->size)
+      bp = bgetz(ip->dev, addr);
+    else
+      bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    // directories are metadata; file contents are not logged.
+    if(ip->type == T_DIR)
+      log_write(bp);
+    else
+      log_data(bp);
     brelse(bp);
   }
 
@@ -532,8 +1954,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
-  iupdate(ip);
+  // block to ip->ext[]. If all of it went to delayed blocks, the
+  // size on disk is unchanged: iflush() writes the i-node.
+  if(mapped)
+    iupdate(ip);
 
   return tot;
 }
@@ -546,6 +1970,246 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories (see fs.h).
+//
+// dirlink() turns a directory of one full block into a hashed
+// one, whose first leaf is block 1. Lookups and inserts read
+// block 0 and one leaf; a full leaf is split in two by hash.
+// Leaves are never merged again.
+
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+#define DIRHEAD(bp)  ((struct dirhead*)((bp)->data + 2*sizeof(struct dirent)))
+#define DIRINDEX(bp) ((struct dirindex*)((bp)->data + 3*sizeof(struct dirent)))
+
+// Is directory dp hashed?
+static int
+dirhashed(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirhead *hd;
+  int r;
+
+  if(dp->size <= BSIZE)
+    return 0;
+  bp = bread_shared(dp->dev, bmap(dp, 0));
+  hd = DIRHEAD(bp);
+  r = hd->inum == 0 && hd->magic == DIRMAGIC;
+  brelse_shared(bp);
+  return r;
+}
+
+// Index slot in block 0 (rp) of the leaf for names with hash h.
+static int
+dirslot(struct buf *rp, uint h)
+{
+  struct dirindex *x = DIRINDEX(rp);
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = DIRHEAD(rp)->n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(x[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Look up name in hashed directory dp.
+// Returns its inum and sets *poff, or returns 0.
+static uint
+hlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint blk, inum;
+  int i;
+
+  bp = bread_shared(dp->dev, bmap(dp, 0));
+  de = (struct dirent*)bp->data;
+  if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0){
+    i = name[1] ? 1 : 0;
+    *poff = i * sizeof(*de);
+    inum = de[i].inum;
+    brelse_shared(bp);
+    return inum;
+  }
+  blk = DIRINDEX(bp)[dirslot(bp, dirhash(name))].block;
+  brelse_shared(bp);
+
+  inum = 0;
+  bp = bread_shared(dp->dev, bmap(dp, blk));
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum && namecmp(name, de[i].name) == 0){
+      *poff = blk*BSIZE + i*sizeof(*de);
+      inum = de[i].inum;
+      break;
+    }
+  }
+  brelse_shared(bp);
+  return inum;
+}
+
+// Move the used entries among the n at from to the first slots
+// of directory block np, file block nblk of dp, and tell the
+// dentry cache where they went.
+static void
+dirmove(struct inode *dp, struct dirent *from, int n, struct buf *np, uint nblk)
+{
+  struct dirent *to = (struct dirent*)np->data;
+  int i, j;
+
+  for(i = 0, j = 0; i < n; i++){
+    if(from[i].inum == 0)
+      continue;
+    to[j] = from[i];
+    denter(dp->dev, dp->inum, to[j].name, to[j].inum,
+           nblk*BSIZE + j*sizeof(struct dirent));
+    j++;
+  }
+  memset(from, 0, n * sizeof(struct dirent));
+}
+
+// Turn dp, a directory of one full block, into a hashed
+// directory with a single leaf.
+static int
+dirconvert(struct inode *dp)
+{
+  struct buf *rp, *bp;
+  uint addr;
+
+  if((addr = bmap(dp, 1)) == 0)
+    return -1;
+  rp = bread(dp->dev, bmap(dp, 0));
+  bp = bread(dp->dev, addr);
+  dirmove(dp, (struct dirent*)rp->data + 2, DPB - 2, bp, 1);
+  DIRHEAD(rp)->magic = DIRMAGIC;
+  DIRHEAD(rp)->n = 1;
+  DIRINDEX(rp)[0].hash = 0;
+  DIRINDEX(rp)[0].block = 1;
+  log_write(rp);
+  log_write(bp);
+  brelse(bp);
+  brelse(rp);
+  dp->size = 2*BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Split the full leaf bp of hashed directory dp, which index
+// slot s in block 0 (rp) points at, moving the upper half of
+// its hashes to a new leaf. Returns -1 if out of disk space,
+// if the index is full or if all names in bp hash the same.
+static int
+dirsplit(struct inode *dp, struct buf *rp, int s, struct buf *bp)
+{
+  struct dirent *de = (struct dirent*)bp->data, *to;
+  struct dirindex *x = DIRINDEX(rp);
+  struct buf *np;
+  uint hs[DPB], addr, nblk;
+  uchar ord[DPB], t;
+  int i, j, k;
+
+  if(DIRHEAD(rp)->n == NDIRINDEX)
+    return -1;
+
+  // Sort the slots of the full leaf by hash, leaving the
+  // leaf itself alone until the split is certain.
+  for(i = 0; i < DPB; i++){
+    hs[i] = dirhash(de[i].name);
+    t = i;
+    for(j = i; j > 0 && hs[ord[j-1]] > hs[t]; j--)
+      ord[j] = ord[j-1];
+    ord[j] = t;
+  }
+  for(k = DPB/2; k < DPB && hs[ord[k]] == hs[ord[k-1]]; k++)
+    ;
+  if(k == DPB){
+    for(k = DPB/2; k > 0 && hs[ord[k]] == hs[ord[k-1]]; k--)
+      ;
+  }
+  if(k == 0)
+    return -1;
+
+  nblk = dp->size / BSIZE;
+  if((addr = bmap(dp, nblk)) == 0)
+    return -1;
+  dp->size += BSIZE;
+  iupdate(dp);
+
+  // Move the upper half to the new leaf. The lower half
+  // keeps its slots, and so its offsets.
+  np = bread(dp->dev, addr);
+  to = (struct dirent*)np->data;
+  for(i = k, j = 0; i < DPB; i++){
+    if(de[ord[i]].inum == 0)
+      continue;
+    to[j] = de[ord[i]];
+    denter(dp->dev, dp->inum, to[j].name, to[j].inum,
+           nblk*BSIZE + j*sizeof(*de));
+    memset(&de[ord[i]], 0, sizeof(*de));
+    j++;
+  }
+  log_write(np);
+  brelse(np);
+  log_write(bp);
+
+  for(i = DIRHEAD(rp)->n; i > s + 1; i--)
+    x[i] = x[i-1];
+  x[s+1].hash = hs[ord[k]];
+  x[s+1].block = nblk;
+  DIRHEAD(rp)->n++;
+  log_write(rp);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp.
+static int
+hlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *rp, *bp;
+  struct dirent *de;
+  uint blk;
+  int i, s;
+
+  for(;;){
+    rp = bread(dp->dev, bmap(dp, 0));
+    s = dirslot(rp, dirhash(name));
+    blk = DIRINDEX(rp)[s].block;
+    bp = bread(dp->dev, bmap(dp, blk));
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPB; i++){
+      if(de[i].inum == 0){
+        strncpy(de[i].name, name, DIRSIZ);
+        de[i].inum = inum;
+        log_write(bp);
+        brelse(bp);
+        brelse(rp);
+        denter(dp->dev, dp->inum, name, inum, blk*BSIZE + i*sizeof(*de));
+        return 0;
+      }
+    }
+    i = dirsplit(dp, rp, s, bp);
+    brelse(bp);
+    brelse(rp);
+    if(i < 0)
+      return -1;
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -557,6 +2221,15 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dlookup(dp->dev, dp->inum, name, &inum, &off))
+    goto found;
+
+  if(dirhashed(dp)){
+    inum = hlookup(dp, name, &off);
+    denter(dp->dev, dp->inum, name, inum, off);
+    goto found;
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,11 +2240,20 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      denter(dp->dev, dp->inum, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  denter(dp->dev, dp->inum, name, 0, 0);
   return 0;
+
+found:
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -589,6 +2271,9 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dirhashed(dp))
+    return hlink(dp, name, inum);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -597,10 +2282,18 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  // Rather than grow a full block, hash the directory.
+  if(off == BSIZE && dp->size == BSIZE){
+    if(dirconvert(dp) < 0)
+      return -1;
+    return hlink(dp, name, inum);
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  denter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -659,21 +2352,22 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilock_shared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlock_shared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlock_shared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlock_shared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -729,62 +2423,72 @@ diriname(struct inode *dp, ushort inum, char name[DIRSIZ], ushort *iparent)
   return -1;
 }
 
-int
-getcwd(char *buf, uint size)
+// Build the path of directory ip into buf, of size bytes, by
+// going up through ".." and looking for each directory's name
+// in its parent. Returns -1 if the path does not fit.
+static int
+cwdwalk(struct inode *ip, char *buf, uint size)
 {
-  struct inode *ip = myproc()->cwd;
-  ilock(ip);
-
-  if(ip->type != T_DIR)
-    panic("getcwd not DIR");
-
-  if (!buf || size <= 1) {
-    iunlock(ip);
-    return -1;
-  }
-
-  if (ip->inum == 1 && size > 1) {
-    buf[0] = '/';
-    buf[1] = '\0';
-    iunlock(ip);
-    return 0;
-  }
-
   // We copy the path to the *end* of the buffer instead of the beginning, then
   // work backwards. Start by null terminating the string.
   buf[size - 1] = '\0';
-  uint bufp = size - 2;
-
-  struct inode *i = iget(ip->dev, ip->inum);
+  uint bufp = size - 1;
 
   ushort iparent;
   ushort last_parent = ip->inum;
   ushort icurrent = ip->inum;
-  char name[DIRSIZ];
-  iunlock(ip);
+  char name[DIRSIZ+1];
+  name[DIRSIZ] = '\0';  // diriname() copies at most DIRSIZ bytes
 
   // Starting with the CWD inode, go up one level (..), read that directory, and
   // search for the CWD inode in it. Repeat the process until we reach /.
-  while (icurrent != 1 && diriname(i, icurrent, name, &iparent) != -1) {
+  // diriname() puts the reference to the directory it searches.
+  struct inode *i = 0;
+  if (icurrent != ROOTINO)
+    i = iget(ip->dev, ip->inum);
+  while (icurrent != ROOTINO) {
+    if (diriname(i, icurrent, name, &iparent) == -1)
+      return -1;
     if (icurrent != last_parent) {
       // We found another path element. Add it to the string.
       int len = strlen(name);
-      if (len < bufp) {
-        bufp -= len;
-        memmove(buf + bufp, name, len);
-        buf[--bufp] = '/';
-      } else {
-        // No more space to store the path.
-        break;
-      }
+      if (len + 1 > bufp)
+        return -1;  // No more space to store the path.
+      bufp -= len;
+      memmove(buf + bufp, name, len);
+      buf[--bufp] = '/';
     }
-    i = iget(ip->dev, iparent);
     icurrent = last_parent;
     last_parent = iparent;
+    if (icurrent != ROOTINO)
+      i = iget(ip->dev, iparent);
   }
 
-  // If we didn't use the entire buffer, slide the string over to the beginning.
-  memmove(buf, buf + bufp, size - bufp);
+  if (bufp == size - 1)
+    buf[--bufp] = '/';
 
+  // Slide the string over to the beginning.
+  memmove(buf, buf + bufp, size - bufp);
   return 0;
 }
+
+// Make sure p->cwdpath holds the path of the current directory.
+// chdir() keeps it in the process; if it could not, find it
+// and keep it. Returns -1 if it cannot be found.
+int
+getcwd(void)
+{
+  struct proc *p = myproc();
+  int r = 0;
+
+  if (p->cwdpath[0] != '\0')
+    return 0;
+
+  begin_op();
+  if (cwdwalk(p->cwd, p->cwdpath, sizeof(p->cwdpath)) < 0) {
+    p->cwdpath[0] = '\0';
+    r = -1;
+  }
+  end_op();
+  return r;
+}
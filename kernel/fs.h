@@ -20,22 +20,48 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint orphan;       // First unlinked inode whose blocks are being freed, or 0
 };
 
-#define FSMAGIC 0x10203040
+#define FSMAGIC 0x10203041  // extent-mapped inodes
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// Most blocks a log transaction can hold: the header, which
+// lists them after three other fields, must fit in one block.
+#define MAXLOG ((BSIZE - 3*sizeof(uint)) / sizeof(uint))
+
+// An extent maps file blocks off .. off+len-1 to the consecutive
+// disk blocks addr .. addr+len-1. In an index block of the extent
+// tree, addr is instead the leaf holding the extents from off on,
+// and len is 0.
+struct extent {
+  uint off;
+  uint addr;
+  uint len;
+};
+
+#define NEXTENT 4   // extents in the inode itself
+#define NEXTPB ((BSIZE - 2*sizeof(ushort)) / sizeof(struct extent))
+
+// Block of the extent tree of a file with more than NEXTENT extents.
+struct extblock {
+  ushort n;             // entries in use
+  ushort depth;         // 0: e[] are extents; 1: e[] index leaves
+  struct extent e[NEXTPB];
+};
+
+// Largest file in blocks; sizes in bytes must fit in an int.
+#define MAXFILE (0x7fffffff / BSIZE)
 
 // On-disk inode structure
 struct dinode {
   short type;           // File type
-  short major;          // Major device number (T_DEVICE only)
+  short major;          // Major device number (T_DEVICE only);
+                        // next orphan if nlink is 0
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // First extents, in file order
+  uint extblk;          // Root of the extent tree for the rest, or 0
 };
 
 // Inodes per block.
@@ -58,3 +84,31 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows one block is hashed. Its block 0
+// keeps "." and "..", then a dirhead and up to NDIRINDEX
+// dirindex entries sorted by hash: the names whose hash is at
+// least index[i].hash, and below index[i+1].hash, are in file
+// block index[i].block. Every slot after ".." has inum 0, so
+// programs that read the directory as dirents skip them.
+#define DIRMAGIC 0x48534944
+#define NDIRINDEX (DPB - 3)
+
+struct dirhead {
+  ushort inum;          // 0
+  ushort pad;
+  uint magic;           // DIRMAGIC
+  uint n;               // index entries in use
+  uint pad2;
+};
+
+struct dirindex {
+  ushort inum;          // 0
+  ushort pad;
+  uint hash;            // lowest name hash in block
+  uint block;           // file block of the directory
+  uint pad2;
+};
+
@@ -0,0 +1,120 @@
+//
+// Hardware performance counters.
+//
+// start.c lets supervisor and user mode read cycle, time, instret
+// and mhpmcounter3..6. Only machine mode may choose the events the
+// programmable counters count, so hpmevent() records the choice
+// and each hart's scheduler asks timervec to apply it (see
+// mcall_hpmevent()) the next time it passes through.
+//
+// The scheduler snapshots the counters before switching to a
+// process and adds the difference to p->hpm when it switches
+// back, so each process is charged only for the time it ran.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "hpm.h"
+#include "proc.h"
+#include "defs.h"
+
+struct {
+  struct spinlock lock;
+  uint64 event[NHPM];  // event selector for mhpmcounter3..6
+  int gen;             // bumped on every change
+} hpm;
+
+void
+hpminit(void)
+{
+  initlock(&hpm.lock, "hpm");
+}
+
+static uint64
+r_hpmcounter(int n)
+{
+  uint64 x = 0;
+
+  switch(n){
+  case 3:
+    asm volatile("csrr %0, hpmcounter3" : "=r" (x) );
+    break;
+  case 4:
+    asm volatile("csrr %0, hpmcounter4" : "=r" (x) );
+    break;
+  case 5:
+    asm volatile("csrr %0, hpmcounter5" : "=r" (x) );
+    break;
+  case 6:
+    asm volatile("csrr %0, hpmcounter6" : "=r" (x) );
+    break;
+  }
+  return x;
+}
+
+// Make programmable counter i (0..NHPM-1) count event on every hart.
+// Event numbers are platform specific; an unsupported event
+// leaves the counter reading 0.
+int
+hpmevent(int i, uint64 event)
+{
+  if(i < 0 || i >= NHPM)
+    return -1;
+
+  acquire(&hpm.lock);
+  hpm.event[i] = event;
+  hpm.gen++;
+  release(&hpm.lock);
+  return 0;
+}
+
+// Bring this hart's event selectors up to date.
+// Called by the scheduler, between processes.
+void
+hpmsync(struct cpu *c)
+{
+  if(c->hpmgen == hpm.gen)
+    return;
+
+  acquire(&hpm.lock);
+  for(int i = 0; i < NHPM; i++)
+    mcall_hpmevent(HPMFIRST + i, hpm.event[i]);
+  c->hpmgen = hpm.gen;
+  release(&hpm.lock);
+}
+
+// Read this hart's counters.
+void
+hpmread(struct hpmstat *st)
+{
+  st->cycles = r_cycle();
+  st->instret = r_instret();
+  for(int i = 0; i < NHPM; i++)
+    st->hpm[i] = r_hpmcounter(HPMFIRST + i);
+}
+
+// acc += (counters now) - start.
+void
+hpmcharge(struct hpmstat *acc, struct hpmstat *start)
+{
+  struct hpmstat now;
+
+  hpmread(&now);
+  acc->cycles += now.cycles - start->cycles;
+  acc->instret += now.instret - start->instret;
+  for(int i = 0; i < NHPM; i++)
+    acc->hpm[i] += now.hpm[i] - start->hpm[i];
+}
+
+// acc += st.
+void
+hpmadd(struct hpmstat *acc, struct hpmstat *st)
+{
+  acc->cycles += st->cycles;
+  acc->instret += st->instret;
+  for(int i = 0; i < NHPM; i++)
+    acc->hpm[i] += st->hpm[i];
+}
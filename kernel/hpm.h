@@ -0,0 +1,23 @@
+/**
+* @file Hardware performance counter totals.
+* Both the kernel and user programs (benchmark) use this header file.
+*/
+
+#ifndef HPM_H
+#define HPM_H
+
+#define HPMFIRST  3  // first programmable counter used (mhpmcounter3)
+#define NHPM      4  // programmable counters used (mhpmcounter3..6)
+
+// Counts accumulated while a process was running.
+struct hpmstat {
+  uint64 cycles;     // cycle counter
+  uint64 instret;    // instructions retired
+  uint64 hpm[NHPM];  // mhpmcounter3..6, counting events set by hpmevent()
+};
+
+// which totals hpmstat() reports.
+#define HPM_SELF      0  // the calling process
+#define HPM_CHILDREN  1  // children that have been wait()ed for
+
+#endif
@@ -0,0 +1,159 @@
+// Block I/O queue, between the buffer cache and the disk driver.
+//
+// iosubmit() queues disk requests for bufs, sorted by block
+// number. Whenever the device has room, the pending block at or
+// after the head position is started together with the pending
+// blocks that directly follow it, as one request of up to NIOMERGE
+// bufs. The head then moves past that run; when no pending block
+// is left ahead of it, it wraps around to the lowest one (C-SCAN),
+// so a stream of low blocks cannot starve the high ones. The driver
+// calls iodone() when a request completes, which also starts
+// whatever the freed room allows.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "hpm.h"
+#include "proc.h"
+#include "iostat.h"
+
+struct {
+  struct spinlock lock;
+  struct buf *pending;  // sorted by blockno, through qnext
+  int nqueued;          // bufs pending or in flight
+  uint head;            // next blockno to dispatch from
+  struct iostat stat;
+} ioq;
+
+void
+ioqinit(void)
+{
+  initlock(&ioq.lock, "ioq");
+}
+
+// Start as many pending requests as the device will take.
+// Caller holds ioq.lock.
+static void
+dispatch(void)
+{
+  struct buf *b, *last, *next, **pp;
+  int n;
+
+  while(ioq.pending != 0){
+    for(pp = &ioq.pending; *pp && (*pp)->blockno < ioq.head; pp = &(*pp)->qnext)
+      ;
+    if(*pp == 0)
+      pp = &ioq.pending;  // wrap around
+    b = *pp;
+
+    // Merge the run of consecutive blocks starting at b.
+    last = b;
+    n = 1;
+    while(n < NIOMERGE && (next = last->qnext) != 0 &&
+          next->dev == b->dev && next->blockno == last->blockno + 1 &&
+          next->write == b->write){
+      last = next;
+      n++;
+    }
+
+    next = last->qnext;
+    last->qnext = 0;
+    if(virtio_disk_start(b, n, b->write) < 0){
+      // Device queue is full; iodone() will try again.
+      last->qnext = next;
+      break;
+    }
+    *pp = next;
+    ioq.head = last->blockno + 1;
+    ioq.stat.ndispatch++;
+    ioq.stat.nmerged += n - 1;
+  }
+}
+
+// Queue disk requests for bufs bs[0..n-1], all locked, and start
+// what the device will take. Returns without waiting; b->disk is
+// cleared when b's request completes. Reads with b->async set are
+// handed to bdone() instead.
+void
+iosubmit(struct buf **bs, int n, int write)
+{
+  struct buf *b, **pp;
+  int i;
+
+  acquire(&ioq.lock);
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    b->disk = 1;
+    b->write = write;
+    for(pp = &ioq.pending; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+      ;
+    b->qnext = *pp;
+    *pp = b;
+
+    ioq.nqueued++;
+    ioq.stat.nreq++;
+    ioq.stat.depthsum += ioq.nqueued;
+    if(ioq.nqueued > ioq.stat.maxdepth)
+      ioq.stat.maxdepth = ioq.nqueued;
+  }
+  dispatch();
+  release(&ioq.lock);
+}
+
+// Wait for the requests of bufs bs[0..n-1] to complete.
+void
+iowait(struct buf **bs, int n)
+{
+  int i;
+
+  acquire(&ioq.lock);
+  for(i = 0; i < n; i++){
+    while(bs[i]->disk)
+      sleep(bs[i], &ioq.lock);
+  }
+  release(&ioq.lock);
+}
+
+// Read or write b and wait for it.
+void
+iorw(struct buf *b, int write)
+{
+  iosubmit(&b, 1, write);
+  iowait(&b, 1);
+}
+
+// Called by the disk driver when the request for the bufs on
+// the list b, b->qnext, ... has completed.
+void
+iodone(struct buf *b)
+{
+  struct buf *next;
+
+  acquire(&ioq.lock);
+  for(; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->disk = 0;   // disk is done with buf
+    ioq.nqueued--;
+    if(b->async)
+      bdone(b);
+    else
+      wakeup(b);
+  }
+  dispatch();
+  release(&ioq.lock);
+}
+
+// Copy the queue statistics to user address addr.
+int
+iostat(uint64 addr)
+{
+  struct proc *p = myproc();
+
+  return copyout(p->pagetable, addr, (char *)&ioq.stat, sizeof(ioq.stat));
+}
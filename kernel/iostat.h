@@ -0,0 +1,17 @@
+/**
+* @file Block I/O queue statistics.
+* Both the kernel and user programs (bcstat) use this header file.
+*/
+
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+struct iostat {
+  uint64 nreq;       // bufs submitted
+  uint64 ndispatch;  // device requests started
+  uint64 nmerged;    // bufs that joined another buf's request
+  uint64 depthsum;   // sum of the queue depth each buf found
+  uint64 maxdepth;   // most bufs queued or in flight at once
+};
+
+#endif
@@ -0,0 +1,22 @@
+/**
+* @file Spinlock contention statistics.
+* Both the kernel and user programs (lockstat) use this header file.
+*/
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#define LOCKNAME 16
+
+// Totals for every spinlock initialized with the same name
+// (all "proc" locks share one entry, for example).
+// Times are in cycles.
+struct lockstat {
+  char name[LOCKNAME];
+  uint64 nacquire;    // acquisitions
+  uint64 ncontended;  // acquisitions that had to wait
+  uint64 spin;        // cycles spent waiting
+  uint64 maxhold;     // longest time held
+};
+
+#endif
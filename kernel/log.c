@@ -21,6 +21,28 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Otherwise end_op() does not commit: the log daemon, a kernel
+// thread, commits and installs the transaction COMMITTICKS
+// clock ticks after it starts, so that the system calls of that
+// window share one commit. log_force() (fsync) commits at once.
+//
+// Once the header is on disk, system calls may start the next
+// transaction while the committer installs the blocks in their
+// home locations. The next commit waits for the install, since
+// it reuses the log blocks; until then the installed blocks stay
+// pinned in the cache, and the install writes the committed
+// copies from the log, not the cached blocks the next transaction
+// may be changing.
+//
+// Only metadata (inode, bitmap, indirect and directory blocks)
+// goes through the log. Blocks of file data are only recorded
+// by log_data(); commit() writes them to their home locations
+// before the log, so a committed inode never points at data that
+// is not on disk yet. A block freed by a transaction is not
+// reallocated until that transaction commits (log_freed()), so
+// data written early cannot land in a block that the committed
+// file system still uses.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -28,13 +50,23 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, though each batch of NIOBATCH
+// blocks is written with the requests in flight together.
+// mkfs chooses the number of log blocks (sb.nlog).
+//
+// The header carries a checksum over itself and the logged
+// blocks. recover_from_log() only installs a transaction whose
+// checksum matches, so the header need not be cleared after
+// install: once the next transaction starts overwriting the log
+// blocks, the old header no longer matches them.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;        // transaction number
+  uint cksum;      // of seq, n, block[] and the n logged blocks
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOG];
 };
 
 struct log {
@@ -43,45 +75,110 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int installing;  // installing ilh; the next commit must wait.
+  int full;        // begin_op() is waiting for log space.
+  int ncommit;     // commits done, for log_force().
   int dev;
   struct logheader lh;
+  struct logheader ilh;  // committed transaction being installed
+  struct buf ibuf[NIOBATCH]; // its blocks, on their way home
+  int ndata;       // file data blocks of the transaction
+  int data[NLOGDATA];
+  uchar freed[(FSSIZE+7)/8]; // bitmap of blocks the transaction freed
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logd(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < 2 || sb->nlog - 1 > MAXLOG)
+    panic("initlog: bad log size");
+  if (sb->size > FSSIZE)
+    panic("initlog: file system too big");
 
   initlock(&log.lock, "log");
+  for (int i = 0; i < NIOBATCH; i++)
+    initsleeplock(&log.ibuf[i].lock, "log.install");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+
+  if(kthread("logd", logd) < 0)
+    panic("initlog: logd");
 }
 
-// Copy committed blocks from log to their home location
+// Copy the committed blocks of lh from log to their home location
+// Blocks are written NIOBATCH at a time, with the writes in flight together.
+// Except in recovery, the next transaction may be changing the cached
+// blocks already, so they are written from log.ibuf[] and then unpinned.
 static void
-install_trans(int recovering)
+install_trans(struct logheader *lh, int recovering)
 {
-  int tail;
+  struct buf *lbuf, *dbufs[NIOBATCH];
+  int tail, i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < lh->n; tail += n) {
+    n = lh->n - tail;
+    if (n > NIOBATCH)
+      n = NIOBATCH;
+    for (i = 0; i < n; i++) {
+      lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      if (recovering) {
+        dbufs[i] = bread(log.dev, lh->block[tail+i]); // read dst
+      } else {
+        dbufs[i] = &log.ibuf[i];
+        acquiresleep(&dbufs[i]->lock);
+        dbufs[i]->dev = log.dev;
+        dbufs[i]->blockno = lh->block[tail+i];
+      }
+      memmove(dbufs[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bwritev(dbufs, n);  // write dsts to disk
+    for (i = 0; i < n; i++) {
+      if (recovering) {
+        brelse(dbufs[i]);
+        continue;
+      }
+      releasesleep(&dbufs[i]->lock);
+      dbufs[i] = bread(log.dev, lh->block[tail+i]); // pinned, so cached
+      bunpin(dbufs[i]);
+      brelse(dbufs[i]);
+    }
   }
 }
 
+// FNV-1a, a word at a time.
+static uint
+cksum(uint h, void *p, int n)
+{
+  uint *w = (uint *) p;
+  int i;
+
+  for (i = 0; i < n / sizeof(uint); i++)
+    h = (h ^ w[i]) * 16777619;
+  return h;
+}
+
+// Checksum of the in-memory header fields, to be extended
+// with the contents of the logged blocks.
+static uint
+cksum_head(void)
+{
+  uint h = 2166136261;
+
+  h = cksum(h, &log.lh.seq, sizeof(log.lh.seq));
+  h = cksum(h, &log.lh.n, sizeof(log.lh.n));
+  return cksum(h, log.lh.block, log.lh.n * sizeof(log.lh.block[0]));
+}
+
 // Read the log header from disk into the in-memory log header
 static void
 read_head(void)
@@ -89,7 +186,11 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
+  log.lh.seq = lh->seq;
+  log.lh.cksum = lh->cksum;
   log.lh.n = lh->n;
+  if (log.lh.n < 0 || log.lh.n > log.size - 1)
+    log.lh.n = 0;
   for (i = 0; i < log.lh.n; i++) {
     log.lh.block[i] = lh->block[i];
   }
@@ -105,6 +206,8 @@ write_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
+  hb->seq = log.lh.seq;
+  hb->cksum = log.lh.cksum;
   hb->n = log.lh.n;
   for (i = 0; i < log.lh.n; i++) {
     hb->block[i] = log.lh.block[i];
@@ -113,13 +216,66 @@ write_head(void)
   brelse(buf);
 }
 
+// Does the checksum in the header read from disk match
+// the header and the log blocks?
+static int
+valid_log(void)
+{
+  uint h = cksum_head();
+  int tail;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, log.start+tail+1);
+    h = cksum(h, lbuf->data, BSIZE);
+    brelse(lbuf);
+  }
+  return h == log.lh.cksum;
+}
+
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  if (log.lh.n > 0) {
+    if (valid_log())
+      install_trans(&log.lh, 1); // if committed, copy from log to disk
+    else
+      printf("log: discarding torn transaction %d\n", log.lh.seq);
+  }
+  // Installing again after another crash is harmless,
+  // so the header is left as it is.
   log.lh.n = 0;
-  write_head(); // clear the log
+}
+
+// Commit the current transaction as soon as the system calls
+// in it have finished and the previous one is installed, then
+// install it while the next transaction goes on. Caller holds
+// log.lock, which is held again on return.
+static void
+docommit(void)
+{
+  log.committing = 1;
+  while(log.outstanding > 0 || log.installing)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  commit();
+
+  acquire(&log.lock);
+  log.committing = 0;
+  log.ncommit++;
+  log.installing = log.ilh.n > 0;
+  wakeup(&log);
+  if(log.installing){
+    release(&log.lock);
+    install_trans(&log.ilh, 0);
+    acquire(&log.lock);
+    log.ilh.n = 0;
+    log.installing = 0;
+    wakeup(&log);
+  }
 }
 
 // called at the start of each FS system call.
@@ -130,9 +286,15 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size - 1 ||
+              log.ndata + (log.outstanding+1)*MAXOPDATA > NLOGDATA){
+      // this op might exhaust log space; commit first.
+      if(log.outstanding == 0){
+        docommit();
+      } else {
+        log.full = 1;
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -142,64 +304,137 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and begin_op() is waiting for log space; otherwise
+// leaves the commit to the log daemon.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.outstanding == 0 && log.full && !log.committing){
+    log.full = 0;
+    docommit();
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op() may be waiting for log space, or a commit
+    // for the last operation, and decrementing
+    // log.outstanding has changed both.
     wakeup(&log);
+    if(log.lh.n > 0 || log.ndata > 0)
+      wakeup(&log.lh);
+  }
+  release(&log.lock);
+}
+
+// Commit everything that finished system calls have logged,
+// and wait until it is on disk.
+void
+log_force(void)
+{
+  int n;
+
+  acquire(&log.lock);
+  if(log.committing){
+    // that commit includes every finished system call.
+    n = log.ncommit;
+    while(log.ncommit == n)
+      sleep(&log, &log.lock);
+  } else if(log.lh.n > 0 || log.ndata > 0){
+    docommit();
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+// The log daemon. It sleeps until a transaction has something
+// in it, lets more system calls join for COMMITTICKS, and then
+// commits, unless someone else has committed meanwhile.
+static void
+logd(void)
+{
+  uint ticks0;
+
+  for(;;){
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    while(log.lh.n == 0 && log.ndata == 0)
+      sleep(&log.lh, &log.lock);
+    release(&log.lock);
+
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < COMMITTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    acquire(&log.lock);
+    if(!log.committing && (log.lh.n > 0 || log.ndata > 0))
+      docommit();
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log,
+// and compute the header's checksum of them.
 static void
 write_log(void)
 {
-  int tail;
+  struct buf *from, *to[NIOBATCH];
+  int tail, i, n;
+  uint h = cksum_head();
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > NIOBATCH)
+      n = NIOBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+tail+i+1); // log block
+      from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      h = cksum(h, to[i]->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, n);  // write the log
+    for (i = 0; i < n; i++)
+      brelse(to[i]);
+  }
+  log.lh.cksum = h;
+}
+
+// Write the transaction's file data blocks home and unpin them.
+static void
+write_data(void)
+{
+  struct buf *bufs[NIOBATCH];
+  int done, i, n;
+
+  for (done = 0; done < log.ndata; done += n) {
+    n = log.ndata - done;
+    if (n > NIOBATCH)
+      n = NIOBATCH;
+    for (i = 0; i < n; i++)
+      bufs[i] = bread(log.dev, log.data[done+i]);
+    bwritev(bufs, n);
+    for (i = 0; i < n; i++) {
+      bunpin(bufs[i]);
+      brelse(bufs[i]);
+    }
   }
+  log.ndata = 0;
 }
 
 static void
 commit()
 {
+  write_data();      // Data first, so committed metadata finds it
   if (log.lh.n > 0) {
+    log.lh.seq++;
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    // docommit() installs from a copy, so that the next
+    // transaction can fill log.lh meanwhile.
+    memmove(&log.ilh, &log.lh, sizeof(log.lh));
+    log.lh.n = 0;    // The checksum retires the header on disk
   }
+  memset(log.freed, 0, sizeof(log.freed));
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -217,7 +452,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -234,3 +469,49 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+
+// Like log_write(), for a block of file data: commit() writes
+// it home before the transaction's metadata, instead of logging it.
+void
+log_data(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (log.ndata >= NLOGDATA)
+    panic("too much data in a transaction");
+  if (log.outstanding < 1)
+    panic("log_data outside of trans");
+
+  for (i = 0; i < log.ndata; i++) {
+    if (log.data[i] == b->blockno)
+      break;
+  }
+  if (i == log.ndata) {
+    log.data[i] = b->blockno;
+    bpin(b);
+    log.ndata++;
+  }
+  release(&log.lock);
+}
+
+// Record that the transaction frees block b.
+void
+log_free(uint b)
+{
+  acquire(&log.lock);
+  log.freed[b/8] |= 1 << (b%8);
+  release(&log.lock);
+}
+
+// Was block b freed by the transaction that is not committed yet?
+int
+log_freed(uint b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = (log.freed[b/8] & (1 << (b%8))) != 0;
+  release(&log.lock);
+  return r;
+}
@@ -25,8 +25,12 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    ioqinit();       // block I/O queue
+    dcacheinit();    // directory entry cache
     iinit();         // inode table
     fileinit();      // file table
+    traceinit();     // syscall trace rings
+    hpminit();       // performance counters
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -2,12 +2,29 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // static in-memory i-nodes; more as memory allows
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
+#define LOGSIZE      (MAXOPBLOCKS*10) // default on-disk log blocks; mkfs -l sets it
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define NINODES      200   // inodes on disk
 #define MAXPATH      128   // maximum file path name
+#define NTRACE       128   // syscall trace records per CPU
+#define NPROFPAGE    16    // max pages of profile samples per process
+#define NLOCKSTAT    64    // distinct spinlock names with statistics
+#define BCACHEMINFREE 256 // free pages the buffer cache leaves to others
+#define NBSHRINK     16    // buffer cache pages kalloc() reclaims at once
+#define NREADAHEAD   32    // max blocks read ahead of a sequential reader
+#define NIOBATCH     8     // disk writes the log keeps in flight at once
+#define NIOMERGE     16    // max blocks merged into one disk request
+#define MAXOPDATA    64    // max file data blocks any FS op writes
+#define NLOGDATA     (MAXOPDATA*8) // max file data blocks in a transaction
+#define COMMITTICKS  1     // clock ticks the log gathers system calls for
+#define SLEEPSPIN    10000 // sleeplock spins on a running holder before sleeping
+#define NPREALLOC    32    // blocks reserved ahead of a sequential writer
+#define NDENTRY      128   // directory entries cached
+#define NDELAYMAX    256   // unallocated file blocks held before flushd writes them at once
+#define FLUSHTICKS   10    // clock ticks file data may wait for allocation
@@ -3,8 +3,11 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
 #include "defs.h"
+#include "syscall.h"
+#include "strace.h"
 
 struct cpu cpus[NCPU];
 
@@ -170,6 +173,11 @@ freeproc(struct proc *p)
   p->xstate = 0;
   p->state = UNUSED;
   p->syscall_count = 0;
+  memset(&p->hpm, 0, sizeof(p->hpm));
+  memset(&p->chpm, 0, sizeof(p->chpm));
+  p->strace = 0;
+  p->kfn = 0;
+  proffree(p);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -249,12 +257,47 @@ userinit(void)
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
+  safestrcpy(p->cwdpath, "/", sizeof(p->cwdpath));
 
   p->state = RUNNABLE;
 
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn, which must never return.
+// It never enters user space, so it needs no user memory.
+// Returns its pid, or -1.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  pid = p->pid;
+
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -308,6 +351,7 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  safestrcpy(np->cwdpath, p->cwdpath, sizeof(p->cwdpath));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -366,6 +410,18 @@ exit(int status)
   end_op();
   p->cwd = 0;
 
+  // Always tell a tracer that p is gone, whatever its filter,
+  // so that it knows when to stop draining the trace rings.
+  if(p->strace){
+    struct tracerec r;
+    memset(&r, 0, sizeof(r));
+    r.pid = p->pid;
+    r.num = SYS_exit;
+    r.args[0] = r.ret = status;
+    r.tentry = r.texit = r_time();
+    trace_put(&r);
+  }
+
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -419,6 +475,8 @@ wait2(uint64 addr, uint64 syscall_count)
               return -1;
           }
 
+          hpmadd(&p->chpm, &pp->hpm);
+          hpmadd(&p->chpm, &pp->chpm);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
@@ -437,6 +495,45 @@ wait2(uint64 addr, uint64 syscall_count)
   }
 }
 
+// Wait for child pid to exit, then copy up to n of its profile
+// samples to addr. The child is left for wait() to reap.
+// Returns the number of samples copied, or -1.
+int
+profwait(int pid, uint64 addr, int n)
+{
+  struct proc *pp;
+  int found, r;
+  struct proc *p = myproc();
+
+  acquire(&wait_lock);
+
+  while (1) {
+    found = 0;
+    for (pp = proc; pp < &proc[NPROC]; pp++) {
+      if (pp->parent == p) {
+        acquire(&pp->lock);
+        if (pp->pid == pid) {
+          found = 1;
+          if (pp->state == ZOMBIE) {
+            r = profcopyout(pp, addr, n);
+            release(&pp->lock);
+            release(&wait_lock);
+            return r;
+          }
+        }
+        release(&pp->lock);
+      }
+    }
+
+    if (!found || killed(p)) {
+      release(&wait_lock);
+      return -1;
+    }
+
+    sleep(p, &wait_lock);
+  }
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int
@@ -472,10 +569,13 @@ scheduler(void)
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        hpmsync(c);
+        hpmread(&c->hpmstart);
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
+        hpmcharge(&p->hpm, &c->hpmstart);
         c->proc = 0;
         found_runnable = 1;
       }
@@ -621,6 +721,73 @@ kill(int pid)
   return -1;
 }
 
+// Set the system call trace mask of the process with the given pid.
+int
+settrace(int pid, uint64 mask)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE){
+      p->strace = mask;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Profile the process with the given pid, keeping up to
+// about n samples; n == 0 stops profiling and drops the samples.
+// Returns the number of samples there is room for, or -1.
+int
+profile(int pid, int n)
+{
+  struct proc *p;
+  int r;
+
+  if(n < 0)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE){
+      r = 0;
+      if(n > 0)
+        r = profalloc(p, n);
+      else
+        proffree(p);
+      release(&p->lock);
+      return r;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Copy the counter totals of the current process (who ==
+// HPM_SELF) or of its reaped children (HPM_CHILDREN) to addr.
+int
+hpmstat(int who, uint64 addr)
+{
+  struct proc *p = myproc();
+  struct hpmstat st;
+
+  if(who == HPM_SELF){
+    // include the time slice that is still running.
+    push_off();
+    st = p->hpm;
+    hpmcharge(&st, &mycpu()->hpmstart);
+    pop_off();
+  } else if(who == HPM_CHILDREN){
+    st = p->chpm;
+  } else {
+    return -1;
+  }
+  return copyout(p->pagetable, addr, (char *)&st, sizeof(st));
+}
+
 void
 setkilled(struct proc *p)
 {
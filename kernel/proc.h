@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct hpmstat hpmstart;    // Counters when c->proc was switched to.
+  int hpmgen;                 // hpm.gen of this hart's event selectors.
 };
 
 extern struct cpu cpus[NCPU];
@@ -103,7 +105,22 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  char cwdpath[MAXPATH];       // Its path, or "" if getcwd() must find it
   char name[16];               // Process name (debugging)
-  int strace;                  // Flag to turn tracing on/off
+  uint64 strace;               // Mask of system calls to trace
+
+  // p->lock must be held when using these:
+  struct profsample *prof[NPROFPAGE]; // Profile sample pages, if profiling
+  int nprof;                   // Samples taken
+  int maxprof;                 // Room for this many samples
   long syscall_count;          // Keeps running count of system calls used
+  struct hpmstat hpm;          // Counters accumulated while running
+  struct hpmstat chpm;         // Totals of children reaped by wait()
+
+  // the sleeplock's lk must be held when using these:
+  struct sleeplock *slwait;    // If non-zero, queued on this sleeplock
+  struct proc *slnext;         // Next waiter in that sleeplock's queue
+  int slshared;                // Waiting for it in shared mode
+
+  void (*kfn)(void);           // Body of a kernel thread, else 0
 };
@@ -0,0 +1,124 @@
+//
+// Sampling profiler.
+//
+// A profiled process has a few pages of struct profsample hanging
+// off p->prof. Every timer interrupt that lands while it runs, in
+// usertrap() or kerneltrap(), appends one sample; profwait() hands
+// the samples to the parent once the process has exited.
+//
+// User programs are built with -fno-omit-frame-pointer, so the
+// return address of each frame is at s0-8 and the caller's s0
+// is at s0-16.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "hpm.h"
+#include "proc.h"
+#include "defs.h"
+#include "prof.h"
+
+#define PROFPERPAGE (PGSIZE / sizeof(struct profsample))
+
+// Free p's sample pages.
+// Caller must hold p->lock.
+void
+proffree(struct proc *p)
+{
+  for(int i = 0; i < NPROFPAGE; i++){
+    if(p->prof[i])
+      kfree(p->prof[i]);
+    p->prof[i] = 0;
+  }
+  p->nprof = 0;
+  p->maxprof = 0;
+}
+
+// Start profiling p with room for about n samples.
+// Returns the number of samples there is room for, or -1.
+// Caller must hold p->lock.
+int
+profalloc(struct proc *p, int n)
+{
+  int npages;
+
+  proffree(p);
+  npages = (n + PROFPERPAGE - 1) / PROFPERPAGE;
+  if(npages > NPROFPAGE)
+    npages = NPROFPAGE;
+  for(int i = 0; i < npages; i++){
+    if((p->prof[i] = kalloc()) == 0){
+      proffree(p);
+      return -1;
+    }
+  }
+  p->maxprof = npages * PROFPERPAGE;
+  return p->maxprof;
+}
+
+// Record a sample for the current process if it is being profiled.
+// kpc is the interrupted kernel pc, or 0 if the timer interrupt
+// came from user space. Called on timer interrupts, before yield().
+void
+profsample(uint64 kpc)
+{
+  struct proc *p = myproc();
+  struct profsample *s;
+  uint64 fp, ra, next;
+  int i;
+
+  if(p == 0 || p->maxprof == 0)
+    return;
+
+  acquire(&p->lock);
+  if(p->nprof >= p->maxprof){
+    release(&p->lock);
+    return;
+  }
+  s = &p->prof[p->nprof / PROFPERPAGE][p->nprof % PROFPERPAGE];
+  memset(s, 0, sizeof(*s));
+
+  i = 0;
+  if(kpc)
+    s->pc[i++] = kpc;
+  s->pc[i++] = p->trapframe->epc;
+  for(fp = p->trapframe->s0; i < PROFDEPTH; fp = next){
+    if(fp < 16 || fp % 8 != 0 || fp > p->sz)
+      break;
+    if(copyin(p->pagetable, (char *)&ra, fp - 8, sizeof(ra)) < 0 ||
+       copyin(p->pagetable, (char *)&next, fp - 16, sizeof(next)) < 0)
+      break;
+    if(ra == 0)
+      break;
+    s->pc[i++] = ra;
+    if(next <= fp)  // stacks grow down, so callers' frames are higher
+      break;
+  }
+  p->nprof++;
+  release(&p->lock);
+}
+
+// Copy up to n of p's samples to user address addr in the
+// current process. Returns the number copied, or -1.
+// Caller must hold p->lock.
+int
+profcopyout(struct proc *p, uint64 addr, int n)
+{
+  struct proc *me = myproc();
+  int done, m;
+
+  if(n > p->nprof)
+    n = p->nprof;
+  for(done = 0; done < n; done += m){
+    m = n - done;
+    if(m > PROFPERPAGE)
+      m = PROFPERPAGE;
+    if(copyout(me->pagetable, addr + done * sizeof(struct profsample),
+               (char *)p->prof[done / PROFPERPAGE], m * sizeof(struct profsample)) < 0)
+      return -1;
+  }
+  return n;
+}
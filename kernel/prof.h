@@ -0,0 +1,19 @@
+/**
+* @file Profile samples taken by the timer interrupt.
+* Both the kernel and user programs (prof) use this header file.
+*/
+
+#ifndef PROF_H
+#define PROF_H
+
+#define PROFDEPTH 8  // pcs recorded per sample
+
+// One sample. pc[0] is where the timer interrupt landed: a kernel
+// pc if it hit while the process was in the kernel, followed by the
+// user pc. The rest are return addresses found by walking the user
+// stack's frame pointers, innermost first. Unused slots are 0.
+struct profsample {
+  uint64 pc[PROFDEPTH];
+};
+
+#endif
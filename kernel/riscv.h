@@ -256,6 +256,19 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+// counter-enable bits, for mcounteren and scounteren.
+#define COUNTEREN_CY (1L << 0) // cycle
+#define COUNTEREN_TM (1L << 1) // time
+#define COUNTEREN_IR (1L << 2) // instret
+#define COUNTEREN_HPM(n) (1L << (n)) // hpmcounter3..31
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -265,6 +278,34 @@ r_time()
   return x;
 }
 
+// clock cycles executed by this hart
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
+// instructions retired by this hart
+static inline uint64
+r_instret()
+{
+  uint64 x;
+  asm volatile("csrr %0, instret" : "=r" (x) );
+  return x;
+}
+
+// ask machine mode (timervec in kernelvec.S) to make
+// mhpmcounter n count event on this hart.
+static inline void
+mcall_hpmevent(uint64 n, uint64 event)
+{
+  register uint64 a0 asm("a0") = n;
+  register uint64 a1 asm("a1") = event;
+  asm volatile("ecall" : : "r" (a0), "r" (a1) : "memory");
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -1,4 +1,17 @@
 // Sleeping locks
+//
+// A waiter first spins for a while if the holder is running on
+// another CPU, since short ilock()/bget() sections end soon.
+// Otherwise it queues itself on the lock and sleeps, and
+// releasesleep() hands the lock to the oldest waiter before
+// waking it, so a spinner cannot take the lock in between and
+// waiters are served in FIFO order.
+//
+// A lock can also be held in shared mode, by any number of
+// readers at once (acquiresleep_shared()). A reader does not
+// pass waiters that are queued already, so that writers are
+// not starved; a released writer wakes the oldest waiter
+// together with the readers queued right behind it.
 
 #include "types.h"
 #include "riscv.h"
@@ -6,27 +19,105 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
 #include "sleeplock.h"
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
-  initlock(&lk->lk, "sleep lock");
+  initlock(&lk->lk, name);
   lk->name = name;
   lk->locked = 0;
+  lk->nshared = 0;
+  lk->owner = 0;
+  lk->qhead = 0;
+  lk->qtail = 0;
   lk->pid = 0;
 }
 
+// Spin without lk->lk while the holder is on a CPU.
+// The reads race with the holder, but only decide whether
+// to keep spinning; acquiresleep() checks again under lk->lk.
+static void
+spinwait(struct sleeplock *lk)
+{
+  struct proc *owner;
+  int i;
+
+  for(i = 0; i < SLEEPSPIN; i++){
+    if(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) == 0)
+      return;
+    owner = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+    if(owner == 0 || owner->state != RUNNING)
+      return;
+  }
+}
+
+// Queue p on lk and sleep until a release wakes it.
+// Caller holds lk->lk.
+static void
+qsleep(struct sleeplock *lk, struct proc *p, int shared)
+{
+  p->slwait = lk;
+  p->slnext = 0;
+  p->slshared = shared;
+  if(lk->qtail)
+    lk->qtail->slnext = p;
+  else
+    lk->qhead = p;
+  lk->qtail = p;
+  while(p->slwait)
+    sleep(&p->slwait, &lk->lk);
+}
+
+// Hand lk to the oldest waiter, and if it wants the lock shared,
+// to the shared waiters queued right behind it, and wake them.
+// Caller holds lk->lk, and lk must be free.
+static void
+qwake(struct sleeplock *lk)
+{
+  struct proc *w;
+  int shared;
+
+  while((w = lk->qhead) != 0){
+    lk->qhead = w->slnext;
+    if(lk->qhead == 0)
+      lk->qtail = 0;
+    shared = w->slshared;
+    if(shared){
+      lk->nshared++;
+    } else {
+      lk->locked = 1;
+      lk->owner = w;
+      lk->pid = w->pid;
+    }
+    w->slwait = 0;
+    wakeup(&w->slwait);
+    if(!shared || lk->qhead == 0 || !lk->qhead->slshared)
+      break;
+  }
+}
+
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *p = myproc();
+
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if(lk->locked || lk->nshared){
+    release(&lk->lk);
+    spinwait(lk);
+    acquire(&lk->lk);
+  }
+  if(lk->locked || lk->nshared){
+    qsleep(lk, p, 0);  // returns holding lk, from qwake()
+    release(&lk->lk);
+    return;
   }
   lk->locked = 1;
-  lk->pid = myproc()->pid;
+  lk->owner = p;
+  lk->pid = p->pid;
   release(&lk->lk);
 }
 
@@ -35,11 +126,45 @@ releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->owner = 0;
   lk->pid = 0;
-  wakeup(lk);
+  qwake(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk in shared mode.
+void
+acquiresleep_shared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+
+  acquire(&lk->lk);
+  if(lk->locked || lk->qhead){
+    release(&lk->lk);
+    spinwait(lk);
+    acquire(&lk->lk);
+  }
+  if(lk->locked || lk->qhead){
+    qsleep(lk, p, 1);  // returns holding lk shared, from qwake()
+    release(&lk->lk);
+    return;
+  }
+  lk->nshared++;
+  release(&lk->lk);
+}
+
+void
+releasesleep_shared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->nshared < 1)
+    panic("releasesleep_shared");
+  if(--lk->nshared == 0)
+    qwake(lk);
   release(&lk->lk);
 }
 
+// Is lk held exclusively by this process?
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -1,7 +1,11 @@
 // Long-term locks for processes
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int nshared;       // Holders in shared mode
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *owner; // Process holding lock, for adaptive spinning
+  struct proc *qhead; // Processes sleeping for the lock, oldest first
+  struct proc *qtail;
   
   // For debugging:
   char *name;        // Name of lock.
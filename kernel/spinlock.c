@@ -1,19 +1,82 @@
 // Mutual exclusion spin locks.
+//
+// These are ticket locks: acquire() takes the next ticket and
+// waits until release() advances owner to it, so CPUs get the
+// lock in the order they asked for it.
+//
+// Every lock also feeds the statistics entry for its name, which
+// getlockstat() copies out (see user/lockstat.c).
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "hpm.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+static struct {
+  uint locked;  // guards n and adding entries; a plain test-and-set lock
+  int n;
+  struct lockstat stat[NLOCKSTAT];
+} lockstats;
+
+// Find or make the statistics entry for locks named name.
+static struct lockstat*
+lockstat_get(char *name)
+{
+  struct lockstat *st;
+
+  push_off();
+  while(__sync_lock_test_and_set(&lockstats.locked, 1) != 0)
+    ;
+  __sync_synchronize();
+
+  for(st = lockstats.stat; st < &lockstats.stat[lockstats.n]; st++){
+    if(strncmp(st->name, name, LOCKNAME) == 0)
+      goto out;
+  }
+  if(lockstats.n == NLOCKSTAT){
+    st = 0;
+    goto out;
+  }
+  st = &lockstats.stat[lockstats.n];
+  safestrcpy(st->name, name, LOCKNAME);
+  __sync_synchronize();
+  lockstats.n++;
+
+out:
+  __sync_lock_release(&lockstats.locked);
+  pop_off();
+  return st;
+}
+
+// Copy up to n statistics entries to user address addr.
+// Returns the number of entries copied, or -1.
+int
+getlockstat(uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for(i = 0; i < n && i < lockstats.n; i++){
+    if(copyout(p->pagetable, addr + i * sizeof(struct lockstat),
+               (char *)&lockstats.stat[i], sizeof(struct lockstat)) < 0)
+      return -1;
+  }
+  return i;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->stat = lockstat_get(name);
 }
 
 // Acquire the lock.
@@ -21,16 +84,26 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+  uint64 t0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
+  //   amoadd.w.aqrl a5, a4, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+
+  if(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket){
+    t0 = r_cycle();
+    while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+      ;
+    if(lk->stat){
+      __sync_fetch_and_add(&lk->stat->ncontended, 1);
+      __sync_fetch_and_add(&lk->stat->spin, r_cycle() - t0);
+    }
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +113,27 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->tacquire = r_cycle();
+  if(lk->stat)
+    __sync_fetch_and_add(&lk->stat->nacquire, 1);
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint64 held, max;
+
   if(!holding(lk))
     panic("release");
 
+  if(lk->stat){
+    held = r_cycle() - lk->tacquire;
+    while((max = lk->stat->maxhold) < held &&
+          !__sync_bool_compare_and_swap(&lk->stat->maxhold, max, held))
+      ;
+  }
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +144,9 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket. Only the holder writes owner, so a
+  // plain increment is enough, but it must be a single store.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -77,7 +157,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->owner != __atomic_load_n(&lk->next, __ATOMIC_RELAXED) && lk->cpu == mycpu());
   return r;
 }
 
@@ -1,9 +1,13 @@
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket now being served; held if != next.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For statistics:
+  struct lockstat *stat; // Shared by all locks with this name.
+  uint64 tacquire;   // cycle counter when acquired.
+};
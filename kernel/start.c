@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
+#include "hpm.h"
 
 void main();
 void timerinit();
@@ -33,8 +34,9 @@ start()
   // disable paging for now.
   w_satp(0);
 
-  // delegate all interrupts and exceptions to supervisor mode.
-  w_medeleg(0xffff);
+  // delegate all interrupts and exceptions to supervisor mode,
+  // except ecalls from supervisor mode, which timervec handles.
+  w_medeleg(0xffff & ~(1 << 9));
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
@@ -43,6 +45,15 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor and user mode read the cycle, time and
+  // instret counters, and the programmable counters that
+  // hpm.c uses.
+  uint64 counters = COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR;
+  for(int i = 0; i < NHPM; i++)
+    counters |= COUNTEREN_HPM(HPMFIRST + i);
+  w_mcounteren(r_mcounteren() | counters);
+  w_scounteren(counters);
+
   // ask for clock interrupts.
   timerinit();
 
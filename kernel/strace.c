@@ -0,0 +1,111 @@
+//
+// System call trace rings.
+//
+// syscall() appends a binary struct tracerec to the ring of the
+// CPU it runs on, so tracing a process costs a few stores instead
+// of a printf() through the uart. User programs drain the rings
+// by reading the trace device (major TRACE) and do the formatting
+// themselves; see user/tracer.c.
+//
+// A full ring overwrites its oldest record, so the newest records
+// (in particular the one exit() leaves behind) are never lost.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+#include "strace.h"
+
+struct tracering {
+  struct spinlock lock;
+  struct tracerec rec[NTRACE];
+  uint r;  // Read index
+  uint w;  // Write index
+};
+
+static struct tracering rings[NCPU];
+
+// Append rp to this CPU's trace ring.
+void
+trace_put(struct tracerec *rp)
+{
+  struct tracering *t;
+
+  push_off();
+  t = &rings[cpuid()];
+  acquire(&t->lock);
+  if(t->w - t->r == NTRACE)
+    t->r++;  // overwrite the oldest record
+  t->rec[t->w++ % NTRACE] = *rp;
+  release(&t->lock);
+  pop_off();
+}
+
+// Remove the oldest record across all CPU rings, so that
+// records come out in (roughly) the order they were made.
+// Returns 0 if every ring is empty.
+static int
+trace_get(struct tracerec *rp)
+{
+  struct tracering *t, *oldest;
+  uint64 when = 0;
+
+  oldest = 0;
+  for(t = rings; t < &rings[NCPU]; t++){
+    acquire(&t->lock);
+    if(t->r != t->w && (oldest == 0 || t->rec[t->r % NTRACE].tentry < when)){
+      oldest = t;
+      when = t->rec[t->r % NTRACE].tentry;
+    }
+    release(&t->lock);
+  }
+  if(oldest == 0)
+    return 0;
+
+  // the writer may have overwritten the head since we looked,
+  // in which case we take the new head.
+  acquire(&oldest->lock);
+  if(oldest->r == oldest->w){
+    release(&oldest->lock);
+    return 0;
+  }
+  *rp = oldest->rec[oldest->r++ % NTRACE];
+  release(&oldest->lock);
+  return 1;
+}
+
+//
+// user read()s from the trace device go here.
+// copies as many whole records as fit in n bytes.
+// never blocks; returns 0 if there is nothing to read.
+//
+static int
+traceread(int user_dst, uint64 dst, int n)
+{
+  struct tracerec r;
+  int tot;
+
+  for(tot = 0; n - tot >= (int)sizeof(r); tot += sizeof(r)){
+    if(trace_get(&r) == 0)
+      break;
+    if(either_copyout(user_dst, dst + tot, &r, sizeof(r)) == -1)
+      break;
+  }
+  return tot;
+}
+
+void
+traceinit(void)
+{
+  struct tracering *t;
+
+  for(t = rings; t < &rings[NCPU]; t++)
+    initlock(&t->lock, "trace");
+
+  devsw[TRACE].read = traceread;
+}
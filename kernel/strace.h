@@ -1,28 +1,28 @@
 /**
-* @file Macros to make printing system call traces easier.
+* @file Binary system call trace records.
+* Both the kernel and user programs (tracer) use this header file.
 */
 
 #ifndef STRACE_H
 #define STRACE_H
 
-// Macro to print an strace for a system call with no arguments
-#define STRACE() \
-  do { if (myproc()->strace) printf("[%d] [%s] %s()\n", \
-           myproc()->pid, myproc()->name, __func__); } while (0)
+// One traced system call. syscall() fills a record in on the way
+// out of every system call made by a traced process and appends it
+// to the current CPU's trace ring; /trace (major TRACE) drains the
+// rings. Timestamps are in ticks of the RISC-V time counter.
+struct tracerec {
+  int pid;          // Process that made the call
+  int num;          // System call number (SYS_*)
+  uint64 args[6];   // a0-a5 at entry
+  uint64 ret;       // Return value (a0 at exit)
+  uint64 tentry;    // time at entry
+  uint64 texit;     // time at exit
+};
 
-// Macro to print an strace for a system call with arguments.
-// Formatting is the same as with printf, e.g.:
-// STRACE_ARGS("path = %s, omode = %d", path, omode);
-#define STRACE_ARGS(fmt, ...) \
-  do { if (myproc()->strace) printf("[%d] [%s] %s(): " fmt "\n", \
-           myproc()->pid, myproc()->name, __func__, __VA_ARGS__); } while (0)
+// Bit for system call num in a strace() filter mask.
+#define TRACE_BIT(num)  (1L << (num))
 
-// Macro to print an strace for the return value from a system call
-// Call this after the system call returns, e.g.:
-// p->trapframe->a0 = syscalls[num]();
-// STRACE_RETURN(num);
-#define STRACE_RETURN(num) \
-  do { if (myproc()->strace) printf("[%d] [syscall #%d] return: %d\n", \
-           myproc()->pid, num, myproc()->trapframe->a0); } while (0)
+// Trace every system call.
+#define TRACE_ALL       (~0L)
 
 #endif
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -108,6 +109,16 @@ extern uint64 sys_time(void);
 extern uint64 sys_strace(void);
 extern uint64 sys_wait2(void);
 extern uint64 sys_getcwd(void);
+extern uint64 sys_profile(void);
+extern uint64 sys_profwait(void);
+extern uint64 sys_hpmevent(void);
+extern uint64 sys_hpmstat(void);
+extern uint64 sys_getlockstat(void);
+extern uint64 sys_bcachestat(void);
+extern uint64 sys_iostat(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_dcachestat(void);
+extern uint64 sys_fallocate(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -139,6 +150,16 @@ static uint64 (*syscalls[])(void) = {
 [SYS_strace]  sys_strace,
 [SYS_wait2]   sys_wait2,
 [SYS_getcwd]  sys_getcwd,
+[SYS_profile] sys_profile,
+[SYS_profwait] sys_profwait,
+[SYS_hpmevent] sys_hpmevent,
+[SYS_hpmstat] sys_hpmstat,
+[SYS_getlockstat] sys_getlockstat,
+[SYS_bcachestat] sys_bcachestat,
+[SYS_iostat]  sys_iostat,
+[SYS_fsync]   sys_fsync,
+[SYS_dcachestat] sys_dcachestat,
+[SYS_fallocate] sys_fallocate,
 };
 
 void
@@ -146,8 +167,21 @@ syscall(void)
 {
   int num;
   struct proc *p = myproc();
+  struct tracerec r;
+  int traced;
 
   num = p->trapframe->a7;
+
+  // Capture the arguments now; the call overwrites a0.
+  traced = num >= 0 && num < 64 && (p->strace & TRACE_BIT(num));
+  if(traced){
+    r.tentry = r_time();
+    r.pid = p->pid;
+    r.num = num;
+    for(int i = 0; i < NELEM(r.args); i++)
+      r.args[i] = argraw(i);
+  }
+
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
@@ -158,5 +192,10 @@ syscall(void)
             p->pid, p->name, num);
     p->trapframe->a0 = -1;
   }
-  STRACE_RETURN(num);
+
+  if(traced){
+    r.ret = p->trapframe->a0;
+    r.texit = r_time();
+    trace_put(&r);
+  }
 }
@@ -26,3 +26,13 @@
 #define SYS_strace 25
 #define SYS_wait2 26
 #define SYS_getcwd 27
+#define SYS_profile 28
+#define SYS_profwait 29
+#define SYS_hpmevent 30
+#define SYS_hpmstat 31
+#define SYS_getlockstat 32
+#define SYS_bcachestat 33
+#define SYS_iostat 34
+#define SYS_fsync  35
+#define SYS_dcachestat 36
+#define SYS_fallocate 37
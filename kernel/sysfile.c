@@ -10,6 +10,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
 #include "fs.h"
 #include "sleeplock.h"
@@ -223,6 +224,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  denter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -263,7 +265,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -355,6 +357,14 @@ sys_open(void)
     return -1;
   }
 
+  // The blocks of a truncated file go to a new inode; fail
+  // the open if none is free.
+  if((omode & O_TRUNC) && ip->type == T_FILE && itrunc(ip) < 0){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -378,10 +388,6 @@ sys_open(void)
     f->off = f->ip->size;
   }
 
-  if((omode & O_TRUNC) && ip->type == T_FILE){
-    itrunc(ip);
-  }
-
   iunlock(ip);
   end_op();
 
@@ -427,29 +433,74 @@ sys_mknod(void)
 uint64
 sys_getcwd(void)
 {
+  struct proc *p = myproc();
   uint64 ubuf;
-  int sz;
+  int sz, n;
 
-  begin_op();
   argaddr(0, &ubuf);
   argint(1, &sz);
 
-  if (sz > PGSIZE) {
-    end_op();
+  // Usually chdir() has left the path in p->cwdpath, and
+  // this needs no transaction.
+  if (sz <= 1 || getcwd() < 0)
     return -1;
-  }
-
-  char *buf = kalloc();
-  getcwd(buf, sz);
-
-  if (copyout(myproc()->pagetable, ubuf, buf, sz) < 0) {
-    end_op();
+  n = strlen(p->cwdpath);
+  if (n >= sz ||
+      copyout(p->pagetable, ubuf, p->cwdpath, n + 1) < 0)
     return -1;
+  return 0;
+}
+
+// Set p->cwdpath to the path of directory path, which is
+// relative to the old one unless it starts with '/', with "."
+// and ".." taken out. Leaves it empty, for getcwd() to find,
+// if the old path was unknown or the new one does not fit.
+static void
+setcwdpath(struct proc *p, char *path)
+{
+  char new[MAXPATH], *s;
+  int n, len;
+
+  n = 0;
+  if(*path != '/'){
+    if(p->cwdpath[0] == 0)
+      return;
+    n = strlen(p->cwdpath);
+    memmove(new, p->cwdpath, n);
+    if(n == 1)
+      n = 0;  // "/": no elements
   }
 
-  kfree(buf);
-  end_op();
-  return 0;
+  for(;;){
+    while(*path == '/')
+      path++;
+    if(*path == 0)
+      break;
+    s = path;
+    while(*path != '/' && *path != 0)
+      path++;
+    len = path - s;
+    if(len == 1 && s[0] == '.')
+      continue;
+    if(len == 2 && s[0] == '.' && s[1] == '.'){
+      while(n > 0 && new[--n] != '/')
+        ;
+      continue;
+    }
+    if(len > DIRSIZ)
+      len = DIRSIZ;  // as namei() sees it
+    if(n + 1 + len >= MAXPATH){
+      p->cwdpath[0] = 0;
+      return;
+    }
+    new[n++] = '/';
+    memmove(new + n, s, len);
+    n += len;
+  }
+  if(n == 0)
+    new[n++] = '/';
+  new[n] = 0;
+  safestrcpy(p->cwdpath, new, sizeof(p->cwdpath));
 }
 
 uint64
@@ -474,6 +525,7 @@ sys_chdir(void)
   iput(p->cwd);
   end_op();
   p->cwd = ip;
+  setcwdpath(p, path);
   return 0;
 }
 
@@ -550,10 +602,68 @@ sys_pipe(void)
   return 0;
 }
 
+// Make everything written so far durable. The log holds all
+// file system changes, so this commits it for any file.
+uint64
+sys_fsync(void)
+{
+  int fd, r = 0;
+  struct file *f;
+
+  if(argfd(0, &fd, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE){
+    // Give delayed blocks disk blocks first.
+    begin_op();
+    ilock(f->ip);
+    r = iflush(f->ip);
+    iunlock(f->ip);
+    end_op();
+  }
+  log_force();
+  return r;
+}
+
+// Allocate disk blocks up to byte off+len-1 of a file, without
+// zeroing them and without changing its size, so that later
+// writes there need not allocate. Files have no holes, so
+// every block from the end of those the file has is allocated,
+// not only those from off on.
+uint64
+sys_fallocate(void)
+{
+  int fd, off, len, n;
+  struct file *f;
+  struct inode *ip;
+  uint nb;
+
+  argint(1, &off);
+  argint(2, &len);
+  if(argfd(0, &fd, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->writable || off < 0 || len <= 0 ||
+     (uint64)off + len > (uint64)MAXFILE*BSIZE)
+    return -1;
+  ip = f->ip;
+  nb = ((uint64)off + len + BSIZE - 1) / BSIZE;
+
+  // A few blocks per transaction, like filewrite().
+  do {
+    begin_op();
+    ilock(ip);
+    n = ip->type == T_FILE ? ifallocate(ip, nb) : -1;
+    iunlock(ip);
+    end_op();
+  } while(n > 0);
+  return n;
+}
+
 uint64
 sys_reboot(void)
 {
   volatile uint32 *test_dev = (uint32 *) VIRT_TEST;
+  iflushall();
+  log_force();
   *test_dev = 0x7777;
 
   return 0;
@@ -563,6 +673,8 @@ uint64
 sys_shutdown(void)
 {
   volatile uint32 *test_dev = (uint32 *) VIRT_TEST;
+  iflushall();
+  log_force();
   *test_dev = 0x5555;
 
   return 0;
@@ -4,16 +4,14 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "hpm.h"
 #include "proc.h"
-#include "strace.h"
-#include "syscall.h"
 
 uint64
 sys_exit(void)
 {
   int n;
   argint(0, &n);
-  STRACE_ARGS("exit status: %d", n);
   exit(n);
   return 0;  // not reached
 }
@@ -21,14 +19,12 @@ sys_exit(void)
 uint64
 sys_getpid(void)
 {
-  STRACE();
   return myproc()->pid;
 }
 
 uint64
 sys_fork(void)
 {
-  STRACE();
   return fork();
 }
 
@@ -47,7 +43,6 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
-  STRACE_ARGS("time to wait: %d", p);
   return wait(p);
 }
 
@@ -59,7 +54,6 @@ sys_sbrk(void)
 
   argint(0, &n);
   addr = myproc()->sz;
-  STRACE_ARGS("Address: %p, n: %d", &addr, n);
   if(growproc(n) < 0)
     return -1;
 
@@ -75,7 +69,6 @@ sys_sleep(void)
   argint(0, &n);
   acquire(&tickslock);
   ticks0 = ticks;
-  STRACE_ARGS("Time: %d, Ticks: %d", n, ticks0);
   while(ticks - ticks0 < n){
     if(killed(myproc())){
       release(&tickslock);
@@ -93,7 +86,6 @@ sys_kill(void)
   int pid;
 
   argint(0, &pid);
-  STRACE_ARGS("PID: %d", pid);
   return kill(pid);
 }
 
@@ -102,8 +94,6 @@ sys_kill(void)
 uint64
 sys_uptime(void)
 {
-  STRACE();
-
   uint xticks;
 
   acquire(&tickslock);
@@ -116,19 +106,113 @@ sys_uptime(void)
 uint64
 sys_time(void)
 {
-  STRACE();
-
   volatile uint64 *timestamp = (uint64 *) GOLDFISH_RTC;
 
   return *timestamp;
 }
 
+// Trace the system calls in mask made by process pid
+// (0 for the caller). A mask of 0 turns tracing off.
 uint64
 sys_strace(void)
 {
-  STRACE();
+  int pid;
+  uint64 mask;
 
-  myproc()->strace = 1;
+  argint(0, &pid);
+  argaddr(1, &mask);
+  if(pid == 0)
+    pid = myproc()->pid;
+  return settrace(pid, mask);
+}
 
-  return 0;
+// Start (n > 0) or stop (n == 0) profiling process pid
+// (0 for the caller), keeping up to about n samples.
+uint64
+sys_profile(void)
+{
+  int pid, n;
+
+  argint(0, &pid);
+  argint(1, &n);
+  if(pid == 0)
+    pid = myproc()->pid;
+  return profile(pid, n);
+}
+
+uint64
+sys_profwait(void)
+{
+  int pid, n;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return profwait(pid, addr, n);
+}
+
+// Make programmable counter i count event on every hart.
+uint64
+sys_hpmevent(void)
+{
+  int i;
+  uint64 event;
+
+  argint(0, &i);
+  argaddr(1, &event);
+  return hpmevent(i, event);
+}
+
+uint64
+sys_hpmstat(void)
+{
+  int who;
+  uint64 addr;
+
+  argint(0, &who);
+  argaddr(1, &addr);
+  return hpmstat(who, addr);
+}
+
+// Copy up to n spinlock statistics entries to a user array.
+uint64
+sys_getlockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return getlockstat(addr, n);
+}
+
+// Copy the buffer cache statistics to a user struct bcachestat.
+uint64
+sys_bcachestat(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return bcachestat(addr);
+}
+
+// Copy the block I/O queue statistics to a user struct iostat.
+uint64
+sys_iostat(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return iostat(addr);
+}
+
+// Copy the directory entry cache statistics to a user struct dcachestat.
+uint64
+sys_dcachestat(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return dcachestat(addr);
 }
@@ -15,8 +15,6 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
-
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
@@ -31,6 +29,8 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+struct dirent rootdir[NINODES];
+int nrootdir;
 
 
 void balloc(int);
@@ -40,6 +40,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bmap(struct dinode *din, uint fbn);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -69,21 +71,30 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum;
   struct dirent de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog < 2 || nlog - 1 > MAXLOG){
+    fprintf(stderr, "mkfs: log must have 2 to %d blocks\n", (int)MAXLOG + 1);
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct extblock) <= BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
@@ -120,22 +131,20 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootdir[nrootdir++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootdir[nrootdir++] = de;
 
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/" (or "kernel/", for kernel.sym)
     char *shortname;
-    if(strncmp(argv[i], "user/", 5) == 0)
-      shortname = argv[i] + 5;
+    if((shortname = rindex(argv[i], '/')) != 0)
+      shortname++;
     else
       shortname = argv[i];
-    
-    assert(index(shortname, '/') == 0);
 
     if((fd = open(argv[i], 0)) < 0)
       die(argv[i]);
@@ -152,7 +161,7 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootdir[nrootdir++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +169,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, rootdir, nrootdir);
 
   balloc(freeblock);
 
@@ -249,6 +253,64 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding file block fbn of din, adding it
+// if fbn is the first block past the end. mkfs only builds
+// extent trees of a single leaf.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  struct extblock eb;
+  struct extent *e, *last;
+  uint off, len;
+  int i;
+
+  last = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len); i++){
+    e = &din->ext[i];
+    off = xint(e->off);
+    len = xint(e->len);
+    if(fbn >= off && fbn < off + len)
+      return xint(e->addr) + fbn - off;
+    last = e;
+  }
+  if(xint(din->extblk)){
+    rsect(xint(din->extblk), &eb);
+    for(i = 0; i < xshort(eb.n); i++){
+      e = &eb.e[i];
+      off = xint(e->off);
+      len = xint(e->len);
+      if(fbn >= off && fbn < off + len)
+        return xint(e->addr) + fbn - off;
+    }
+    last = i > 0 ? &eb.e[i-1] : last;
+  }
+
+  // Grow the last extent, or add one.
+  if(last && xint(last->addr) + xint(last->len) == freeblock){
+    last->len = xint(xint(last->len) + 1);
+  } else {
+    for(i = 0; i < NEXTENT && xint(din->ext[i].len); i++)
+      ;
+    if(i < NEXTENT){
+      e = &din->ext[i];
+    } else {
+      if(xint(din->extblk) == 0){
+        din->extblk = xint(freeblock++);
+        bzero(&eb, sizeof(eb));
+      }
+      assert(xshort(eb.n) < NEXTPB);
+      e = &eb.e[xshort(eb.n)];
+      eb.n = xshort(xshort(eb.n) + 1);
+    }
+    e->off = xint(fbn);
+    e->addr = xint(freeblock);
+    e->len = xint(1);
+  }
+  if(xint(din->extblk))
+    wsect(xint(din->extblk), &eb);
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +318,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -265,22 +326,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -293,6 +339,94 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Must match dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the n entries of directory inum, as a plain list if they
+// fit in one block, else hashed the way the kernel would (see
+// kernel/fs.h), with leaves three quarters full.
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  char buf[BSIZE];
+  struct dinode din;
+  struct dirhead *hd;
+  struct dirindex *x;
+  struct dirent t;
+  uint hs[NINODES], h, off;
+  int start[NDIRINDEX+1];
+  int i, j, nx;
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+
+    // fix size of root inode dir
+    rinode(inum, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(inum, &din);
+    return;
+  }
+
+  // Sort the names after "." and ".." by hash.
+  for(i = 2; i < n; i++){
+    t = de[i];
+    h = dirhash(t.name);
+    for(j = i; j > 2 && hs[j-1] > h; j--){
+      hs[j] = hs[j-1];
+      de[j] = de[j-1];
+    }
+    hs[j] = h;
+    de[j] = t;
+  }
+
+  // Cut into leaves, each ending where the hash changes.
+  nx = 0;
+  for(i = 2; i < n; i = j){
+    if(nx == NDIRINDEX){
+      fprintf(stderr, "mkfs: too many files for one directory\n");
+      exit(1);
+    }
+    start[nx++] = i;
+    j = min(i + DPB*3/4, n);
+    while(j < n && hs[j] == hs[j-1])
+      j++;
+    if(j - i > DPB){
+      fprintf(stderr, "mkfs: too many names with one hash\n");
+      exit(1);
+    }
+  }
+  start[nx] = n;
+
+  bzero(buf, BSIZE);
+  memmove(buf, de, 2 * sizeof(*de));
+  hd = (struct dirhead*)(buf + 2*sizeof(struct dirent));
+  hd->magic = xint(DIRMAGIC);
+  hd->n = xint(nx);
+  x = (struct dirindex*)(buf + 3*sizeof(struct dirent));
+  for(i = 0; i < nx; i++){
+    x[i].hash = xint(i == 0 ? 0 : hs[start[i]]);
+    x[i].block = xint(i + 1);
+  }
+  iappend(inum, buf, BSIZE);
+
+  for(i = 0; i < nx; i++){
+    bzero(buf, BSIZE);
+    memmove(buf, de + start[i], (start[i+1] - start[i]) * sizeof(*de));
+    iappend(inum, buf, BSIZE);
+  }
+}
+
 void
 die(const char *s)
 {
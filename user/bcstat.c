@@ -0,0 +1,101 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/bcachestat.h"
+#include "kernel/iostat.h"
+#include "kernel/dcachestat.h"
+#include "user/user.h"
+
+static void
+print_stat(struct bcachestat *s)
+{
+	uint64 lookups = s->hits + s->misses;
+
+	printf("Hits:\t\t%l\n", s->hits);
+	printf("Misses:\t\t%l\n", s->misses);
+	printf("Evictions:\t%l\n", s->evictions);
+	printf("Buffers:\t%l\n", s->nbuf);
+	if (lookups > 0)
+		printf("Hit rate:\t%d%%\n", (int) (s->hits * 100 / lookups));
+	printf("Read ahead:\t%l\n", s->raissued);
+	if (s->raissued > 0)
+		printf("Used:\t\t%d%%\n", (int) (s->rahits * 100 / s->raissued));
+}
+
+static void
+print_iostat(struct iostat *s)
+{
+	printf("Blocks queued:\t%l\n", s->nreq);
+	printf("Disk requests:\t%l\n", s->ndispatch);
+	if (s->nreq > 0) {
+		printf("Merged:\t\t%d%%\n", (int) (s->nmerged * 100 / s->nreq));
+		printf("Avg depth:\t%d\n", (int) (s->depthsum / s->nreq));
+	}
+	printf("Max depth:\t%l\n", s->maxdepth);
+}
+
+static void
+print_dcachestat(struct dcachestat *s)
+{
+	uint64 lookups = s->hits + s->neghits + s->misses;
+
+	printf("Name hits:\t%l\n", s->hits);
+	printf("Negative hits:\t%l\n", s->neghits);
+	printf("Name misses:\t%l\n", s->misses);
+	if (lookups > 0)
+		printf("Name hit rate:\t%d%%\n",
+				(int) ((s->hits + s->neghits) * 100 / lookups));
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bcachestat before, after;
+	struct iostat iobefore, ioafter;
+	struct dcachestat dbefore, dafter;
+
+	if (argc < 2) {
+		bcachestat(&after);
+		iostat(&ioafter);
+		dcachestat(&dafter);
+		print_stat(&after);
+		print_iostat(&ioafter);
+		print_dcachestat(&dafter);
+		return 0;
+	}
+
+	// Report only what happened while the command ran.
+	// The maximum queue depth is since boot.
+	bcachestat(&before);
+	iostat(&iobefore);
+	dcachestat(&dbefore);
+	int pid = fork();
+	if (pid == -1) {
+		fprintf(2, "Error forking.\n");
+		return 1;
+	} else if (pid == 0) {
+		exec(argv[1], argv + 1);
+		fprintf(2, "bcstat: exec %s failed\n", argv[1]);
+		exit(1);
+	}
+	wait(0);
+	bcachestat(&after);
+	iostat(&ioafter);
+	dcachestat(&dafter);
+
+	after.hits -= before.hits;
+	after.misses -= before.misses;
+	after.evictions -= before.evictions;
+	after.raissued -= before.raissued;
+	after.rahits -= before.rahits;
+	ioafter.nreq -= iobefore.nreq;
+	ioafter.ndispatch -= iobefore.ndispatch;
+	ioafter.nmerged -= iobefore.nmerged;
+	ioafter.depthsum -= iobefore.depthsum;
+	dafter.hits -= dbefore.hits;
+	dafter.neghits -= dbefore.neghits;
+	dafter.misses -= dbefore.misses;
+	print_stat(&after);
+	print_iostat(&ioafter);
+	print_dcachestat(&dafter);
+	return 0;
+}
@@ -1,32 +1,56 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/hpm.h"
 #include "user/user.h"
 
 int
 main(int argc, char *argv[])
 {
-	if (argc == 1) {
+	// -e event,... makes mhpmcounter3.. count the given
+	// (platform specific, decimal) events as well.
+	int nevents = 0;
+	int i = 1;
+	if (argc > 2 && strcmp(argv[1], "-e") == 0) {
+		char *list = argv[2];
+		char *event;
+		while ((event = next_token(&list, ",")) != NULL && nevents < NHPM) {
+			if (hpmevent(nevents, atoi(event)) < 0)
+				fprintf(2, "Cannot set event %s.\n", event);
+			nevents++;
+		}
+		i = 3;
+	}
+
+	if (i >= argc) {
 		printf("Please provide command to benchmark.\n");
 		return 1;
 	}
 
+	struct hpmstat before, after;
+	hpmstat(HPM_CHILDREN, &before);
+
 	int pid = fork();
 	if (pid == -1) {
 		fprintf(2, "Error forking.\n");
 		return 1;
 	} else if (pid == 0) {
-		exec(*(argv + 1), argv + 1);
+		exec(*(argv + i), argv + i);
 	} else {
 		uint64 start = time();
 		int status, num_syscalls;
 		wait2(&status, &num_syscalls);
 		uint64 end = time();
 		uint64 delta = (end - start) / 1000000;
+		hpmstat(HPM_CHILDREN, &after);
 
 		printf("------------------\n");
 		printf("Benchmark Complete\n");
 		printf("Time Elapsed:\t%d ms\n", delta);
 		printf("System Calls:\t%d\n", num_syscalls);
+		printf("Cycles:\t\t%l\n", after.cycles - before.cycles);
+		printf("Instructions:\t%l\n", after.instret - before.instret);
+		for (int e = 0; e < nevents; e++)
+			printf("hpmcounter%d:\t%l\n", HPMFIRST + e, after.hpm[e] - before.hpm[e]);
 	}
 
 	return 0;
@@ -0,0 +1,62 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+static struct lockstat before[NLOCKSTAT], after[NLOCKSTAT];
+
+int
+main(int argc, char *argv[])
+{
+	int top = 10;
+	int i = 1;
+
+	if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+		top = atoi(argv[i + 1]);
+		i += 2;
+	}
+
+	// With a command, report only what happened while it ran.
+	int nbefore = 0;
+	if (i < argc) {
+		nbefore = getlockstat(before, NLOCKSTAT);
+		int pid = fork();
+		if (pid == -1) {
+			fprintf(2, "Error forking.\n");
+			return 1;
+		} else if (pid == 0) {
+			exec(argv[i], argv + i);
+			fprintf(2, "lockstat: exec %s failed\n", argv[i]);
+			exit(1);
+		}
+		wait(0);
+	}
+	int n = getlockstat(after, NLOCKSTAT);
+
+	// Entries are only ever appended, so before[j] names after[j].
+	for (int j = 0; j < nbefore; j++) {
+		after[j].nacquire -= before[j].nacquire;
+		after[j].ncontended -= before[j].ncontended;
+		after[j].spin -= before[j].spin;
+	}
+
+	// Most time spent waiting first.
+	for (int j = 1; j < n; j++) {
+		struct lockstat s = after[j];
+		int k;
+		for (k = j; k > 0 && after[k - 1].spin < s.spin; k--)
+			after[k] = after[k - 1];
+		after[k] = s;
+	}
+
+	printf("lock\t\tacquired\tcontended\tspin cycles\tmax hold\n");
+	for (int j = 0; j < n && j < top; j++) {
+		printf("%s\t%s%l\t\t%l\t\t%l\t\t%l\n", after[j].name,
+				strlen(after[j].name) < 8 ? "\t" : "",
+				after[j].nacquire, after[j].ncontended,
+				after[j].spin, after[j].maxhold);
+	}
+
+	return 0;
+}
@@ -0,0 +1,272 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/memlayout.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+#define MAXSAMPLES 1024
+
+struct sym {
+	uint64 addr;
+	char *name;
+};
+
+struct symtab {
+	struct sym *syms;
+	int n;
+};
+
+struct count {
+	char *name;
+	int n;
+};
+
+static struct symtab usyms, ksyms;
+
+static char*
+strdup(const char *s)
+{
+	char *d = malloc(strlen(s) + 1);
+	strcpy(d, s);
+	return d;
+}
+
+// Skip section, file and local label symbols.
+static int
+is_function(char *name)
+{
+	int len = strlen(name);
+	if (name[0] == '.' || name[0] == '$' || len == 0)
+		return 0;
+	if (len > 2 && name[len - 2] == '.' && (name[len - 1] == 'c' || name[len - 1] == 'S'))
+		return 0;
+	return 1;
+}
+
+static uint64
+parse_hex(char *s)
+{
+	uint64 x = 0;
+	for (; *s; s++) {
+		if (*s >= '0' && *s <= '9')
+			x = x * 16 + *s - '0';
+		else if (*s >= 'a' && *s <= 'f')
+			x = x * 16 + *s - 'a' + 10;
+		else
+			break;
+	}
+	return x;
+}
+
+// Load a .sym file ("<hex address> <name>" per line), sorted by address.
+static void
+load_syms(struct symtab *t, char *path)
+{
+	struct stat st;
+	int fd, n, i, j;
+	char *buf, *line;
+
+	t->n = 0;
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(2, "prof: cannot read %s\n", path);
+		return;
+	}
+
+	buf = malloc(st.size + 1);
+	for (n = 0; n < st.size; ) {
+		int r = read(fd, buf + n, st.size - n);
+		if (r <= 0)
+			break;
+		n += r;
+	}
+	buf[n] = '\0';
+	close(fd);
+
+	int lines = 0;
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '\n')
+			lines++;
+	}
+	t->syms = malloc((lines + 1) * sizeof(struct sym));
+
+	char *p = buf;
+	while ((line = next_token(&p, "\n")) != NULL) {
+		char *name = strchr(line, ' ');
+		if (name == 0 || !is_function(name + 1))
+			continue;
+		struct sym s = { parse_hex(line), name + 1 };
+
+		// insertion sort; symbol tables are a few hundred lines
+		for (j = t->n; j > 0 && t->syms[j - 1].addr > s.addr; j--)
+			t->syms[j] = t->syms[j - 1];
+		t->syms[j] = s;
+		t->n++;
+	}
+}
+
+// Name of the function containing pc.
+static char*
+lookup(uint64 pc)
+{
+	struct symtab *t = pc >= KERNBASE ? &ksyms : &usyms;
+	int lo = 0, hi = t->n - 1, best = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (t->syms[mid].addr <= pc) {
+			best = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return best < 0 ? "?" : t->syms[best].name;
+}
+
+// Name of frame i of s. Return addresses point after the call,
+// so look up the byte before them.
+static char*
+frame_name(struct profsample *s, int i)
+{
+	return lookup(i == 0 ? s->pc[0] : s->pc[i] - 1);
+}
+
+static void
+add_count(struct count *counts, int *ncounts, char *name)
+{
+	for (int i = 0; i < *ncounts; i++) {
+		if (strcmp(counts[i].name, name) == 0) {
+			counts[i].n++;
+			return;
+		}
+	}
+	counts[*ncounts].name = strdup(name);
+	counts[*ncounts].n = 1;
+	(*ncounts)++;
+}
+
+// Self time per function: one count per sample for the function
+// the interrupt landed in.
+static void
+flat_profile(struct profsample *samples, int n)
+{
+	struct count *counts = malloc(n * sizeof(struct count));
+	int ncounts = 0, i, j;
+
+	for (i = 0; i < n; i++)
+		add_count(counts, &ncounts, frame_name(&samples[i], 0));
+
+	for (i = 1; i < ncounts; i++) {
+		struct count c = counts[i];
+		for (j = i; j > 0 && counts[j - 1].n < c.n; j--)
+			counts[j] = counts[j - 1];
+		counts[j] = c;
+	}
+
+	printf("samples\t%%\tfunction\n");
+	for (i = 0; i < ncounts; i++)
+		printf("%d\t%d%%\t%s\n", counts[i].n, counts[i].n * 100 / n, counts[i].name);
+}
+
+// One "outer;...;inner count" line per distinct stack, the input
+// format of flamegraph.pl. Kernel frames are suffixed with _[k].
+static void
+folded_stacks(struct profsample *samples, int n)
+{
+	struct count *counts = malloc(n * sizeof(struct count));
+	int ncounts = 0;
+	char line[512];
+
+	for (int i = 0; i < n; i++) {
+		struct profsample *s = &samples[i];
+		int depth = 0;
+		while (depth < PROFDEPTH && s->pc[depth] != 0)
+			depth++;
+
+		line[0] = '\0';
+		for (int f = depth - 1; f >= 0; f--) {
+			char *name = frame_name(s, f);
+			if (strlen(line) + strlen(name) + 6 >= sizeof(line))
+				break;
+			strcpy(line + strlen(line), name);
+			if (s->pc[f] >= KERNBASE)
+				strcpy(line + strlen(line), "_[k]");
+			if (f > 0)
+				strcpy(line + strlen(line), ";");
+		}
+		add_count(counts, &ncounts, line);
+	}
+
+	for (int i = 0; i < ncounts; i++)
+		printf("%s %d\n", counts[i].name, counts[i].n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int folded = 0;
+	int i = 1;
+
+	if (i < argc && strcmp(argv[i], "-f") == 0) {
+		folded = 1;
+		i++;
+	}
+	if (i == argc) {
+		fprintf(2, "usage: prof [-f] command [args...]\n");
+		return 1;
+	}
+
+	// Hold the child until profiling is on.
+	int p[2];
+	char c;
+	pipe(p);
+	int pid = fork();
+	if (pid == -1) {
+		fprintf(2, "Error forking.\n");
+		return 1;
+	} else if (pid == 0) {
+		close(p[1]);
+		read(p[0], &c, 1);
+		close(p[0]);
+		exec(argv[i], argv + i);
+		fprintf(2, "prof: exec %s failed\n", argv[i]);
+		exit(1);
+	}
+	close(p[0]);
+	if (profile(pid, MAXSAMPLES) < 0)
+		fprintf(2, "prof: cannot profile %d\n", pid);
+	close(p[1]);
+
+	struct profsample *samples = malloc(MAXSAMPLES * sizeof(struct profsample));
+	int n = profwait(pid, samples, MAXSAMPLES);
+	wait(0);
+	if (n <= 0) {
+		fprintf(2, "prof: no samples\n");
+		return 1;
+	}
+
+	// /ls -> /ls.sym
+	char path[32];
+	char *name = argv[i];
+	for (char *s = argv[i]; *s; s++) {
+		if (*s == '/')
+			name = s + 1;
+	}
+	if (strlen(name) + 6 > sizeof(path)) {
+		fprintf(2, "prof: name too long\n");
+		return 1;
+	}
+	path[0] = '/';
+	strcpy(path + 1, name);
+	strcpy(path + strlen(path), ".sym");
+	load_syms(&usyms, path);
+	load_syms(&ksyms, "/kernel.sym");
+
+	if (folded)
+		folded_stacks(samples, n);
+	else
+		flat_profile(samples, n);
+
+	return 0;
+}
@@ -1,18 +1,179 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "kernel/memlayout.h"
+#include "kernel/syscall.h"
+#include "kernel/strace.h"
 #include "user/user.h"
 
+static char *names[] = {
+	[SYS_fork]     "fork",
+	[SYS_exit]     "exit",
+	[SYS_wait]     "wait",
+	[SYS_pipe]     "pipe",
+	[SYS_read]     "read",
+	[SYS_kill]     "kill",
+	[SYS_exec]     "exec",
+	[SYS_fstat]    "fstat",
+	[SYS_chdir]    "chdir",
+	[SYS_dup]      "dup",
+	[SYS_getpid]   "getpid",
+	[SYS_sbrk]     "sbrk",
+	[SYS_sleep]    "sleep",
+	[SYS_uptime]   "uptime",
+	[SYS_open]     "open",
+	[SYS_write]    "write",
+	[SYS_mknod]    "mknod",
+	[SYS_unlink]   "unlink",
+	[SYS_link]     "link",
+	[SYS_mkdir]    "mkdir",
+	[SYS_close]    "close",
+	[SYS_reboot]   "reboot",
+	[SYS_shutdown] "shutdown",
+	[SYS_time]     "time",
+	[SYS_strace]   "strace",
+	[SYS_wait2]    "wait2",
+	[SYS_getcwd]   "getcwd",
+	[SYS_profile]  "profile",
+	[SYS_profwait] "profwait",
+	[SYS_hpmevent] "hpmevent",
+	[SYS_hpmstat]  "hpmstat",
+	[SYS_getlockstat] "getlockstat",
+	[SYS_bcachestat] "bcachestat",
+	[SYS_iostat]   "iostat",
+	[SYS_fsync]    "fsync",
+	[SYS_dcachestat] "dcachestat",
+	[SYS_fallocate] "fallocate",
+};
+
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+
+static void
+usage(void)
+{
+	fprintf(2, "usage: tracer [-s syscall,...] -p pid\n");
+	fprintf(2, "       tracer [-s syscall,...] command [args...]\n");
+	exit(1);
+}
+
+// Turn a comma-separated list of system call names into a trace mask.
+static uint64
+parse_mask(char *list)
+{
+	uint64 mask = 0;
+	char *name;
+
+	while ((name = next_token(&list, ",")) != NULL) {
+		int num;
+		for (num = 1; num < NNAMES; num++) {
+			if (names[num] && strcmp(name, names[num]) == 0)
+				break;
+		}
+		if (num == NNAMES) {
+			fprintf(2, "tracer: unknown system call %s\n", name);
+			exit(1);
+		}
+		mask |= TRACE_BIT(num);
+	}
+	return mask;
+}
+
+static void
+print_rec(struct tracerec *r)
+{
+	char *name = "?";
+	if (r->num > 0 && r->num < NNAMES && names[r->num])
+		name = names[r->num];
+
+	// time counter ticks -> microseconds
+	uint64 us = (r->texit - r->tentry) * 1000000 / CLINT_FREQ;
+
+	printf("[%d] %s(%p, %p, %p) = %d <%l us>\n", r->pid, name,
+			r->args[0], r->args[1], r->args[2], (int) r->ret, us);
+}
+
 int
 main(int argc, char *argv[])
 {
-	int pid = fork();
+	uint64 mask = TRACE_ALL;
+	int pid = 0;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			mask = parse_mask(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			pid = atoi(argv[++i]);
+		} else {
+			usage();
+		}
+	}
+	if ((pid == 0) == (i == argc))
+		usage();
+
+	int fd = open("/trace", O_RDONLY);
+	if (fd < 0) {
+		mknod("/trace", TRACE, 0);
+		fd = open("/trace", O_RDONLY);
+	}
+	if (fd < 0) {
+		fprintf(2, "tracer: cannot open /trace\n");
+		exit(1);
+	}
+
 	if (pid == 0) {
-		strace();
-		exec(*(argv + 1), argv + 1);
-	} else {
-		int time;
-		wait(&time);
+		// Stop the child until tracing is on, so that no call is missed.
+		int p[2];
+		char c;
+		pipe(p);
+		pid = fork();
+		if (pid == 0) {
+			close(p[1]);
+			read(p[0], &c, 1);
+			close(p[0]);
+			exec(argv[i], argv + i);
+			fprintf(2, "tracer: exec %s failed\n", argv[i]);
+			exit(1);
+		}
+		close(p[0]);
+		strace(pid, mask);
+		close(p[1]);
+	} else if (strace(pid, mask) < 0) {
+		fprintf(2, "tracer: no process %d\n", pid);
+		exit(1);
+	}
+
+	// Format records as they arrive until the traced process exits.
+	// The kernel always emits an exit record for a traced process.
+	struct tracerec recs[16];
+	for (;;) {
+		int r = read(fd, recs, sizeof(recs));
+		if (r < 0) {
+			fprintf(2, "tracer: read /trace failed\n");
+			exit(1);
+		}
+		int n = r / sizeof(recs[0]);
+		if (n == 0) {
+			sleep(1);
+			continue;
+		}
+
+		int done = 0;
+		for (int j = 0; j < n; j++) {
+			if (recs[j].pid == pid && recs[j].num == SYS_exit)
+				done = 1;
+			if (recs[j].num == SYS_exit || (mask & TRACE_BIT(recs[j].num)))
+				print_rec(&recs[j]);
+		}
+		if (done)
+			break;
 	}
 
+	close(fd);
+	wait(0);
 	return 0;
 }
@@ -12,6 +12,11 @@
 #define STDERR_FILENO   2
 
 struct stat;
+struct hpmstat;
+struct lockstat;
+struct bcachestat;
+struct iostat;
+struct dcachestat;
 
 // system calls
 int fork(void);
@@ -38,9 +43,19 @@ int uptime(void);
 uint64 reboot(void);
 uint64 shutdown(void);
 uint64 time(void);
-uint64 strace(void);
+int strace(int, uint64);
 int wait2(int*, int*);
 int getcwd(char*, int);
+int profile(int, int);
+int profwait(int, void*, int);
+int hpmevent(int, uint64);
+int hpmstat(int, struct hpmstat*);
+int getlockstat(struct lockstat*, int);
+int bcachestat(struct bcachestat*);
+int iostat(struct iostat*);
+int fsync(int);
+int dcachestat(struct dcachestat*);
+int fallocate(int, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -18,6 +18,7 @@
 //
 
 #define BUFSZ  ((MAXOPBLOCKS+2)*BSIZE)
+#define BIGFILE 400  // blocks in writebig's file, past the old 268 limit
 
 char buf[BUFSZ];
 
@@ -586,7 +587,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +607,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == BIGFILE - 1){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1329,6 +1330,106 @@ unlinkread(char *s)
   unlink("unlinkread");
 }
 
+// can I still read delayed data of an unlinked, open file
+// after the flusher has run?
+void
+unlinkflush(char *s)
+{
+  enum { SZ = 5 };
+  int fd, fd1;
+
+  fd = open("unlinkflush", O_CREATE | O_RDWR);
+  fd1 = open("unlinkflush", O_RDONLY);
+  if(fd < 0 || fd1 < 0){
+    printf("%s: create unlinkflush failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "hello", SZ) != SZ){
+    printf("%s: write unlinkflush failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("unlinkflush") != 0){
+    printf("%s: unlink unlinkflush failed\n", s);
+    exit(1);
+  }
+  sleep(FLUSHTICKS * 2);
+
+  memset(buf, 0, SZ);
+  if(read(fd1, buf, sizeof(buf)) != SZ){
+    printf("%s: unlinkflush read failed\n", s);
+    exit(1);
+  }
+  if(memcmp(buf, "hello", SZ) != 0){
+    printf("%s: unlinkflush wrong data\n", s);
+    exit(1);
+  }
+  close(fd1);
+}
+
+// fallocate() must not change the size, and writes into the
+// allocated blocks must read back.
+void
+fallocatetest(char *s)
+{
+  enum { HEAD = 100, N = 8 };
+  struct stat st;
+  int fd, i;
+
+  unlink("falloc");
+  fd = open("falloc", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create falloc failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'h', HEAD);
+  if(write(fd, buf, HEAD) != HEAD){
+    printf("%s: write falloc failed\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, 0, 2*N*BSIZE) != 0){
+    printf("%s: fallocate failed\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) != 0 || st.size != HEAD){
+    printf("%s: fallocate changed the size to %d\n", s, st.size);
+    exit(1);
+  }
+  for(i = 0; i < N*BSIZE; i++)
+    buf[i] = 'a' + i % 23;
+  if(write(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: write into fallocated blocks failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("falloc", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open falloc failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, HEAD) != HEAD || buf[0] != 'h' || buf[HEAD-1] != 'h'){
+    printf("%s: falloc head wrong\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: falloc read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N*BSIZE; i++){
+    if(buf[i] != 'a' + i % 23){
+      printf("%s: falloc wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: falloc read past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("falloc");
+}
+
 void
 linktest(char *s)
 {
@@ -2607,6 +2708,8 @@ struct test {
   {fourfiles, "fourfiles"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
+  {unlinkflush, "unlinkflush"},
+  {fallocatetest, "fallocate"},
   {linktest, "linktest"},
   {concreate, "concreate"},
   {linkunlink, "linkunlink"},
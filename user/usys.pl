@@ -42,3 +42,13 @@ entry("time");
 entry("strace");
 entry("wait2");
 entry("getcwd");
+entry("profile");
+entry("profwait");
+entry("hpmevent");
+entry("hpmstat");
+entry("getlockstat");
+entry("bcachestat");
+entry("iostat");
+entry("fsync");
+entry("dcachestat");
+entry("fallocate");